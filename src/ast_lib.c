@@ -0,0 +1,435 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast_lib.h"
+#include "sdm_lib.h"
+#include "token_lib.h"
+
+typedef struct {
+  TokenStream stream;
+  Ast *ast;
+  AstIndexArray scratch;  // Arguments of the calls currently being parsed, innermost last
+  AstIndexArray heights;  // Height of the tree under each node parsed so far, from first_node on
+  uint32_t first_node;
+  uint32_t depth;         // How many expressions are being parsed inside one another
+  bool failed;
+} AstParser;
+
+static uint32_t parse_expression(AstParser *p);
+
+// Per thread, so that work done ahead of time on other threads can keep quiet
+static _Thread_local bool errors_muted = false;
+
+void ast_mute_errors(bool muted) {
+  errors_muted = muted;
+}
+
+void ast_error(const Ast *ast, size_t offset, const char *format, ...) {
+  if (errors_muted) return;
+
+  // Lines and columns are only needed here, so they are worked out from the offset
+  const char *data = ast->source.data;
+  size_t line = 1;
+  size_t line_start = 0;
+  for (size_t i=0; i<offset; i++) {
+    if (data[i] == '\n') {
+      line++;
+      line_start = i + 1;
+    }
+  }
+
+  // Formatted in one piece so that messages from different threads don't interleave.
+  // Most fit on the stack; longer ones are formatted on the heap rather than cut short.
+  va_list args, measure;
+  va_start(args, format);
+  va_copy(measure, args);
+  int prefix_length = snprintf(NULL, 0, "%s:%zu:%zu: ERROR: ", ast->filename, line, offset - line_start + 1);
+  int body_length = vsnprintf(NULL, 0, format, measure);
+  va_end(measure);
+  if (prefix_length < 0 || body_length < 0) {
+    va_end(args);
+    return;
+  }
+
+  char buffer[1024];
+  size_t size = (size_t)prefix_length + (size_t)body_length + 1;
+  char *message = buffer;
+  if (size > sizeof(buffer)) {
+    message = malloc(size);
+    if (message == NULL) {
+      fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+      exit(1);
+    }
+  }
+  snprintf(message, size, "%s:%zu:%zu: ERROR: ", ast->filename, line, offset - line_start + 1);
+  vsnprintf(message + prefix_length, size - prefix_length, format, args);
+  va_end(args);
+  fprintf(ast->errors != NULL ? ast->errors : stderr, "%s\n", message);
+  if (message != buffer) free(message);
+}
+
+static void depth_error(AstParser *p, size_t offset) {
+  if (p->failed) return;
+  p->failed = true;
+  ast_error(p->ast, offset, "Expression is nested too deeply (the limit is %d)", AST_MAX_DEPTH);
+}
+
+static uint32_t node_height(const AstParser *p, uint32_t index) {
+  return p->heights.data[index - p->first_node];
+}
+
+static uint32_t push_node(AstParser *p, AstNodeKind kind, uint8_t op, uint32_t lhs, uint32_t rhs, size_t offset) {
+  if (p->ast->nodes.length >= AST_NO_NODE) {
+    fprintf(stderr, "ERR: %s has too many syntax nodes.\n", p->ast->filename);
+    exit(1);
+  }
+
+  // Everything that walks the tree later recurses, so its height is bounded here (a long
+  // chain like 1 + 1 + ... is as deep as it is long)
+  uint32_t below = 0;
+  switch (kind) {
+    case AST_NODE_NEGATE:
+    case AST_NODE_EXPR_STMT:
+      below = node_height(p, lhs);
+      break;
+    case AST_NODE_BINARY:
+      below = node_height(p, lhs);
+      if (node_height(p, rhs) > below) below = node_height(p, rhs);
+      break;
+    case AST_NODE_NAMED_ARG:
+    case AST_NODE_LET:
+      below = node_height(p, rhs);
+      break;
+    case AST_NODE_CALL: {
+      AstCallArgs args = { .count = p->ast->extra.data[rhs], .args = &p->ast->extra.data[rhs + 1] };
+      for (uint32_t i=0; i<args.count; i++) {
+        if (node_height(p, args.args[i]) > below) below = node_height(p, args.args[i]);
+      }
+    } break;
+    default:
+      break;
+  }
+  if (below >= AST_MAX_DEPTH) {
+    depth_error(p, offset);
+    return AST_NO_NODE;
+  }
+
+  AstNode node = { .kind = kind, .op = op, .lhs = lhs, .rhs = rhs, .offset = (uint32_t)offset };
+  SDM_ARRAY_PUSH(p->ast->nodes, node);
+  SDM_ARRAY_PUSH(p->heights, below + 1);
+  return (uint32_t)(p->ast->nodes.length - 1);
+}
+
+static void parse_error(AstParser *p, const Token *token, const char *expected) {
+  // Only the first error is reported; everything after it is likely a consequence
+  if (p->failed) return;
+  p->failed = true;
+
+  if (token->token_type == TOKEN_TYPE_EOF) {
+    ast_error(p->ast, token->source.index, "Expected %s but found the end of the input", expected);
+  } else {
+    ast_error(p->ast, token->source.index, "Expected %s but found '%.*s'", expected,
+              (int)token->length, p->ast->source.data + token->source.index);
+  }
+}
+
+static const Token *peek(AstParser *p, size_t k) {
+  return token_stream_peek(&p->stream, k);
+}
+
+static bool accept(AstParser *p, TokenType type) {
+  if (peek(p, 0)->token_type != type) return false;
+  token_stream_next(&p->stream);
+  return true;
+}
+
+static bool expect(AstParser *p, TokenType type, const char *expected, Token *out) {
+  Token token = token_stream_next(&p->stream);
+  if (token.token_type != type) {
+    parse_error(p, &token, expected);
+    return false;
+  }
+  if (out != NULL) *out = token;
+  return true;
+}
+
+static bool starts_with_sign(AstParser *p, const Token *token) {
+  if (token->token_type != TOKEN_TYPE_INT && token->token_type != TOKEN_TYPE_FLOAT) return false;
+  char c = p->ast->source.data[token->source.index];
+  return c == '-' || c == '+';
+}
+
+static uint32_t parse_call(AstParser *p, KeywordKind kind, uint32_t callee, size_t offset) {
+  token_stream_next(&p->stream);  // The opening paren
+
+  // Arguments are gathered on the scratch stack and copied to Ast.extra in one go at
+  // the end, so the arguments of nested calls don't interleave with ours
+  size_t base = p->scratch.length;
+  if (peek(p, 0)->token_type != TOKEN_TYPE_CPAREN) {
+    do {
+      uint32_t arg;
+      const Token *first = peek(p, 0);
+      if (first->token_type == TOKEN_TYPE_ID && peek(p, 1)->token_type == TOKEN_TYPE_ASSIGNMENT) {
+        size_t arg_offset = first->source.index;
+        uint32_t name = first->as.id_token.symbol;
+        token_stream_next(&p->stream);
+        token_stream_next(&p->stream);
+        uint32_t value = parse_expression(p);
+        if (value == AST_NO_NODE) return AST_NO_NODE;
+        arg = push_node(p, AST_NODE_NAMED_ARG, 0, name, value, arg_offset);
+        if (arg == AST_NO_NODE) return AST_NO_NODE;
+      } else {
+        arg = parse_expression(p);
+        if (arg == AST_NO_NODE) return AST_NO_NODE;
+      }
+      SDM_ARRAY_PUSH(p->scratch, arg);
+    } while (accept(p, TOKEN_TYPE_COMMA));
+  }
+  if (!expect(p, TOKEN_TYPE_CPAREN, "',' or ')'", NULL)) return AST_NO_NODE;
+
+  AstIndexArray *extra = &p->ast->extra;
+  uint32_t args_index = (uint32_t)extra->length;
+  SDM_ARRAY_PUSH(*extra, (uint32_t)(p->scratch.length - base));
+  for (size_t i=base; i<p->scratch.length; i++) {
+    SDM_ARRAY_PUSH(*extra, p->scratch.data[i]);
+  }
+  p->scratch.length = base;
+
+  return push_node(p, AST_NODE_CALL, kind, callee, args_index, offset);
+}
+
+static uint32_t parse_primary(AstParser *p) {
+  Token token = token_stream_next(&p->stream);
+  size_t offset = token.source.index;
+  Ast *ast = p->ast;
+
+  switch (token.token_type) {
+    case TOKEN_TYPE_INT:
+      SDM_ARRAY_PUSH(ast->ints, token_int_value(&token));
+      return push_node(p, AST_NODE_INT, 0, (uint32_t)(ast->ints.length - 1), 0, offset);
+    case TOKEN_TYPE_FLOAT:
+      SDM_ARRAY_PUSH(ast->floats, token_float_value(&token));
+      return push_node(p, AST_NODE_FLOAT, 0, (uint32_t)(ast->floats.length - 1), 0, offset);
+    case TOKEN_TYPE_STRING:
+      SDM_ARRAY_PUSH(ast->strings, token_string_value(&token));
+      return push_node(p, AST_NODE_STRING, 0, (uint32_t)(ast->strings.length - 1), 0, offset);
+    case TOKEN_TYPE_ID:
+      if (peek(p, 0)->token_type == TOKEN_TYPE_OPAREN) {
+        return parse_call(p, KEYWORD_NONE, token.as.id_token.symbol, offset);
+      }
+      return push_node(p, AST_NODE_IDENT, 0, token.as.id_token.symbol, 0, offset);
+    case TOKEN_TYPE_KEYWORD:
+      // Type names double as constructors, e.g. Drift(L = 0.1)
+      if (token.as.keyword_token.kind != KEYWORD_LET && peek(p, 0)->token_type == TOKEN_TYPE_OPAREN) {
+        return parse_call(p, token.as.keyword_token.kind, 0, offset);
+      }
+      break;
+    case TOKEN_TYPE_OPAREN: {
+      uint32_t inner = parse_expression(p);
+      if (inner == AST_NO_NODE) return AST_NO_NODE;
+      if (!expect(p, TOKEN_TYPE_CPAREN, "')'", NULL)) return AST_NO_NODE;
+      return inner;
+    }
+    default: break;
+  }
+
+  parse_error(p, &token, "an expression");
+  return AST_NO_NODE;
+}
+
+static uint32_t parse_unary(AstParser *p) {
+  // Every nested expression (in parentheses, a call or after a sign) comes through here,
+  // so this is where the parser's own recursion is bounded
+  const Token *next = peek(p, 0);
+  if (p->depth >= AST_MAX_DEPTH) {
+    depth_error(p, next->source.index);
+    return AST_NO_NODE;
+  }
+  p->depth++;
+
+  uint32_t node;
+  if (next->token_type == TOKEN_TYPE_SUB) {
+    size_t offset = next->source.index;
+    token_stream_next(&p->stream);
+    node = parse_unary(p);
+    if (node != AST_NO_NODE) node = push_node(p, AST_NODE_NEGATE, 0, node, 0, offset);
+  } else if (next->token_type == TOKEN_TYPE_ADD) {
+    token_stream_next(&p->stream);
+    node = parse_unary(p);
+  } else {
+    node = parse_primary(p);
+  }
+
+  p->depth--;
+  return node;
+}
+
+static uint32_t parse_term(AstParser *p) {
+  uint32_t lhs = parse_unary(p);
+  while (lhs != AST_NO_NODE) {
+    TokenType op = peek(p, 0)->token_type;
+    if (op != TOKEN_TYPE_MULT && op != TOKEN_TYPE_DIV) break;
+    token_stream_next(&p->stream);
+    uint32_t rhs = parse_unary(p);
+    if (rhs == AST_NO_NODE) return AST_NO_NODE;
+    lhs = push_node(p, AST_NODE_BINARY, op, lhs, rhs, p->ast->nodes.data[lhs].offset);
+  }
+  return lhs;
+}
+
+static uint32_t parse_expression(AstParser *p) {
+  uint32_t lhs = parse_term(p);
+  while (lhs != AST_NO_NODE) {
+    const Token *next = peek(p, 0);
+    TokenType op;
+    if (next->token_type == TOKEN_TYPE_ADD || next->token_type == TOKEN_TYPE_SUB) {
+      op = next->token_type;
+      token_stream_next(&p->stream);
+    } else if (starts_with_sign(p, next)) {
+      // "x -1": the lexer has folded the sign into the literal, so this is x + (-1)
+      op = TOKEN_TYPE_ADD;
+    } else {
+      break;
+    }
+    uint32_t rhs = parse_term(p);
+    if (rhs == AST_NO_NODE) return AST_NO_NODE;
+    lhs = push_node(p, AST_NODE_BINARY, op, lhs, rhs, p->ast->nodes.data[lhs].offset);
+  }
+  return lhs;
+}
+
+static uint32_t parse_statement(AstParser *p) {
+  const Token *first = peek(p, 0);
+  size_t offset = first->source.index;
+
+  if (first->token_type == TOKEN_TYPE_KEYWORD && first->as.keyword_token.kind == KEYWORD_LET) {
+    // let <name>: <type> = <expression>;
+    token_stream_next(&p->stream);
+    Token name, type;
+    if (!expect(p, TOKEN_TYPE_ID, "a name", &name)) return AST_NO_NODE;
+    if (!expect(p, TOKEN_TYPE_COLON, "':'", NULL)) return AST_NO_NODE;
+    if (!expect(p, TOKEN_TYPE_KEYWORD, "a type", &type)) return AST_NO_NODE;
+    if (type.as.keyword_token.kind == KEYWORD_LET) {
+      parse_error(p, &type, "a type");
+      return AST_NO_NODE;
+    }
+    if (!expect(p, TOKEN_TYPE_ASSIGNMENT, "'='", NULL)) return AST_NO_NODE;
+    uint32_t value = parse_expression(p);
+    if (value == AST_NO_NODE) return AST_NO_NODE;
+    if (!expect(p, TOKEN_TYPE_SEMICOLON, "';'", NULL)) return AST_NO_NODE;
+    return push_node(p, AST_NODE_LET, type.as.keyword_token.kind, name.as.id_token.symbol, value, offset);
+  }
+
+  uint32_t expression = parse_expression(p);
+  if (expression == AST_NO_NODE) return AST_NO_NODE;
+  if (!expect(p, TOKEN_TYPE_SEMICOLON, "';'", NULL)) return AST_NO_NODE;
+  return push_node(p, AST_NODE_EXPR_STMT, 0, expression, 0, offset);
+}
+
+bool parse_program(Parser *lexer, Ast *ast) {
+  ast->filename = lexer->filename;
+  ast->source = lexer->contents;
+  AstParser p = { .ast = ast, .first_node = (uint32_t)ast->nodes.length };
+  token_stream_init(&p.stream, lexer);
+
+  // There are fewer nodes than tokens, so reserving for the token estimate means the
+  // node arrays are allocated once
+  size_t estimate = estimate_token_count(sdm_sized_str_as_sv(lexer->contents.data + lexer->index,
+                                                             lexer->contents.length - lexer->index));
+  SDM_ENSURE_ARRAY_MIN_CAP(ast->nodes, ast->nodes.length + estimate);
+  SDM_ENSURE_ARRAY_MIN_CAP(p.heights, estimate);
+
+  while (!p.failed && peek(&p, 0)->token_type != TOKEN_TYPE_EOF) {
+    uint32_t statement = parse_statement(&p);
+    if (statement != AST_NO_NODE) SDM_ARRAY_PUSH(ast->statements, statement);
+  }
+
+  token_stream_end(&p.stream, ast->errors != NULL ? ast->errors : stderr);
+  return !p.failed;
+}
+
+static const char *binary_op_text(uint8_t op) {
+  switch (op) {
+    case TOKEN_TYPE_ADD:  return "+";
+    case TOKEN_TYPE_SUB:  return "-";
+    case TOKEN_TYPE_MULT: return "*";
+    case TOKEN_TYPE_DIV:  return "/";
+    default:              return "?";
+  }
+}
+
+void dump_ast_node(sdm_writer *writer, const Ast *ast, uint32_t index) {
+  // Nodes are written as s-expressions, e.g. (let d1 Drift (Drift (= L 0.01)))
+  const AstNode *node = ast_node(ast, index);
+  switch ((AstNodeKind)node->kind) {
+    case AST_NODE_INT:
+      sdm_write_int(writer, ast->ints.data[node->lhs]);
+      break;
+    case AST_NODE_FLOAT:
+      sdm_write_double(writer, ast->floats.data[node->lhs]);
+      break;
+    case AST_NODE_STRING:
+      sdm_write_bytes(writer, "\"", 1);
+      sdm_write_sv(writer, ast->strings.data[node->lhs]);
+      sdm_write_bytes(writer, "\"", 1);
+      break;
+    case AST_NODE_IDENT:
+      sdm_write_sv(writer, symbol_name(node->lhs));
+      break;
+    case AST_NODE_NEGATE:
+      sdm_write_cstr(writer, "(- ");
+      dump_ast_node(writer, ast, node->lhs);
+      sdm_write_bytes(writer, ")", 1);
+      break;
+    case AST_NODE_BINARY:
+      sdm_write_bytes(writer, "(", 1);
+      sdm_write_cstr(writer, binary_op_text(node->op));
+      sdm_write_bytes(writer, " ", 1);
+      dump_ast_node(writer, ast, node->lhs);
+      sdm_write_bytes(writer, " ", 1);
+      dump_ast_node(writer, ast, node->rhs);
+      sdm_write_bytes(writer, ")", 1);
+      break;
+    case AST_NODE_CALL: {
+      sdm_write_bytes(writer, "(", 1);
+      if (node->op == KEYWORD_NONE) sdm_write_sv(writer, symbol_name(node->lhs));
+      else sdm_write_cstr(writer, keyword_name(node->op));
+      AstCallArgs args = ast_call_args(ast, node);
+      for (uint32_t i=0; i<args.count; i++) {
+        sdm_write_bytes(writer, " ", 1);
+        dump_ast_node(writer, ast, args.args[i]);
+      }
+      sdm_write_bytes(writer, ")", 1);
+    } break;
+    case AST_NODE_NAMED_ARG:
+      sdm_write_cstr(writer, "(= ");
+      sdm_write_sv(writer, symbol_name(node->lhs));
+      sdm_write_bytes(writer, " ", 1);
+      dump_ast_node(writer, ast, node->rhs);
+      sdm_write_bytes(writer, ")", 1);
+      break;
+    case AST_NODE_LET:
+      sdm_write_cstr(writer, "(let ");
+      sdm_write_sv(writer, symbol_name(node->lhs));
+      sdm_write_bytes(writer, " ", 1);
+      sdm_write_cstr(writer, keyword_name(node->op));
+      sdm_write_bytes(writer, " ", 1);
+      dump_ast_node(writer, ast, node->rhs);
+      sdm_write_bytes(writer, ")", 1);
+      break;
+    case AST_NODE_EXPR_STMT:
+      dump_ast_node(writer, ast, node->lhs);
+      break;
+    case AST_NODE_KIND_COUNT:
+      break;
+  }
+}
+
+void dump_ast(sdm_writer *writer, const Ast *ast) {
+  for (size_t i=0; i<ast->statements.length; i++) {
+    dump_ast_node(writer, ast, ast->statements.data[i]);
+    sdm_write_bytes(writer, "\n", 1);
+  }
+}
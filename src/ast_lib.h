@@ -0,0 +1,104 @@
+#ifndef _AST_LIB_H
+#define _AST_LIB_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sdm_lib.h"
+#include "token_lib.h"
+
+// The syntax tree is stored flat: every node lives in Ast.nodes and refers to its
+// children by 32-bit index, so a tree is a handful of contiguous arrays that can be
+// walked (or written out) front to back.  What lhs and rhs mean depends on the kind.
+typedef enum {
+  AST_NODE_INT,        // lhs: index into Ast.ints
+  AST_NODE_FLOAT,      // lhs: index into Ast.floats
+  AST_NODE_STRING,     // lhs: index into Ast.strings
+  AST_NODE_IDENT,      // lhs: symbol id
+  AST_NODE_NEGATE,     // lhs: operand
+  AST_NODE_BINARY,     // op: TOKEN_TYPE_ADD/SUB/MULT/DIV; lhs, rhs: operands
+  AST_NODE_CALL,       // op: KeywordKind of a constructor, or KEYWORD_NONE with lhs the callee's symbol; rhs: AstCallArgs in Ast.extra
+                       // (lattice_init sets a constructor's lhs to its slot in the lattice's tables)
+  AST_NODE_NAMED_ARG,  // lhs: symbol id of the argument name; rhs: value (op: ElementParam, set by lattice_init)
+  AST_NODE_LET,        // op: KeywordKind of the declared type; lhs: symbol id of the name; rhs: value
+  AST_NODE_EXPR_STMT,  // lhs: expression
+  AST_NODE_KIND_COUNT,
+} AstNodeKind;
+
+#define AST_NO_NODE UINT32_MAX
+// How deeply expressions can nest, which bounds the recursion of everything that walks them
+#define AST_MAX_DEPTH 1000
+
+typedef struct {
+  uint8_t kind;
+  uint8_t op;
+  uint32_t lhs;
+  uint32_t rhs;
+  uint32_t offset;  // Byte offset of the node's first token in the input
+} AstNode;
+
+// The arguments of a call are stored in Ast.extra as a count followed by that many node indices
+typedef struct {
+  uint32_t count;
+  const uint32_t *args;
+} AstCallArgs;
+
+typedef struct {
+  size_t capacity;
+  size_t length;
+  AstNode *data;
+} AstNodeArray;
+
+typedef struct {
+  size_t capacity;
+  size_t length;
+  uint32_t *data;
+} AstIndexArray;
+
+typedef struct {
+  size_t capacity;
+  size_t length;
+  int64_t *data;
+} AstIntArray;
+
+typedef struct {
+  size_t capacity;
+  size_t length;
+  double *data;
+} AstFloatArray;
+
+typedef struct {
+  const char *filename;
+  sdm_string_view source;
+  FILE *errors;              // Where ast_error() writes; stderr if NULL
+  AstNodeArray nodes;
+  AstIndexArray statements;  // Top-level LET and EXPR_STMT nodes, in source order
+  AstIndexArray extra;
+  AstIntArray ints;
+  AstFloatArray floats;
+  sdm_sv_array strings;      // Decoded string literals
+} Ast;
+
+static inline const AstNode *ast_node(const Ast *ast, uint32_t index) {
+  return &ast->nodes.data[index];
+}
+
+static inline AstCallArgs ast_call_args(const Ast *ast, const AstNode *call) {
+  return (AstCallArgs){ .count = ast->extra.data[call->rhs], .args = &ast->extra.data[call->rhs + 1] };
+}
+
+// Parses a whole program from the lexer's current position.  Syntax errors are
+// reported with ast_error() and parsing stops at the first one, returning false.
+bool parse_program(Parser *lexer, Ast *ast);
+
+// Prints "file:line:col: ERROR: <message>" for a byte offset into the parsed source
+void ast_error(const Ast *ast, size_t offset, const char *format, ...);
+// Stops (or restarts) ast_error() printing anything on the calling thread
+void ast_mute_errors(bool muted);
+
+void dump_ast_node(sdm_writer *writer, const Ast *ast, uint32_t index);
+void dump_ast(sdm_writer *writer, const Ast *ast);
+
+#endif // !_AST_LIB_H
+
@@ -0,0 +1,52 @@
+#ifndef _ELEMENT_SCHEMA_H
+#define _ELEMENT_SCHEMA_H
+
+// The kinds of lattice element and the parameters they take.  This is the one place a
+// kind is written down: the lexer takes its keyword from here (see KEYWORD_LIST), and
+// line_lib its table, defaults, argument binding and sums.
+
+// Every argument an element constructor can take.  As with the keywords, the length
+// and first and last characters of each name select its slot in a perfect-hash
+// table, and a collision is caught at compile time by -Woverride-init.  C can't take
+// a character out of a string in a constant expression, so those two characters are
+// written out by hand.
+#define ELEMENT_PARAM_LIST(X) \
+  X(L,         'L', 'L')      \
+  X(Phi,       'P', 'i')      \
+  X(K1,        'K', '1')      \
+  X(K2,        'K', '2')      \
+  X(K3,        'K', '3')      \
+  X(Frequency, 'F', 'y')      \
+  X(Voltage,   'V', 'e')      \
+  X(HarNum,    'H', 'm')
+
+// The schema of each kind of element, as Y(type, param, default, sum) for each
+// parameter it takes.  Adding a kind means adding a line here and a row in
+// ELEMENT_KIND_ROWS; everything else follows from those two.
+#define DRIFT_PARAMS(Y, type)     Y(type, L, 0.0, LENGTH)
+#define QUAD_PARAMS(Y, type)      Y(type, L, 0.0, LENGTH) Y(type, Phi, 0.0, ANGLE) Y(type, K1, 0.0, K1L)
+#define BEND_PARAMS(Y, type)      Y(type, L, 0.0, LENGTH) Y(type, Phi, 0.0, ANGLE) Y(type, K1, 0.0, K1L)
+#define SEXTUPOLE_PARAMS(Y, type) Y(type, L, 0.0, LENGTH) Y(type, K2, 0.0, K2L)
+#define OCTUPOLE_PARAMS(Y, type)  Y(type, L, 0.0, LENGTH) Y(type, K3, 0.0, K3L)
+// A cavity's Phi is its phase, not a bending angle
+#define CAVITY_PARAMS(Y, type)    Y(type, L, 0.0, LENGTH) Y(type, Frequency, 0.0, NONE) Y(type, Voltage, 0.0, NONE) Y(type, HarNum, 0.0, NONE) Y(type, Phi, 0.0, NONE)
+
+// ROW(X, KEYWORD, Type, table, PARAMS, first, last), where Type is also the keyword's
+// spelling and first and last are its first and last characters, as in KEYWORD_LIST
+#define ELEMENT_KIND_ROWS(ROW, X)                                        \
+  ROW(X, DRIFT,     Drift,     drifts,     DRIFT_PARAMS,     'D', 't')   \
+  ROW(X, QUAD,      Quad,      quads,      QUAD_PARAMS,      'Q', 'd')   \
+  ROW(X, BEND,      Bend,      bends,      BEND_PARAMS,      'B', 'd')   \
+  ROW(X, SEXTUPOLE, Sextupole, sextupoles, SEXTUPOLE_PARAMS, 'S', 'e')   \
+  ROW(X, OCTUPOLE,  Octupole,  octupoles,  OCTUPOLE_PARAMS,  'O', 'e')   \
+  ROW(X, CAVITY,    Cavity,    cavities,   CAVITY_PARAMS,    'C', 'y')
+
+// X(KEYWORD, Type, table, PARAMS)
+#define ELEMENT_KIND_ROW(X, keyword, type, table, params, first, last) X(keyword, type, table, params)
+#define ELEMENT_KINDS(X) ELEMENT_KIND_ROWS(ELEMENT_KIND_ROW, X)
+
+// X(KEYWORD, "Type", first, last), the shape of a KEYWORD_LIST entry
+#define ELEMENT_KEYWORD_ROW(X, keyword, type, table, params, first, last) X(keyword, #type, first, last)
+#define ELEMENT_KEYWORDS(X) ELEMENT_KIND_ROWS(ELEMENT_KEYWORD_ROW, X)
+
+#endif // _ELEMENT_SCHEMA_H
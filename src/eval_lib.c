@@ -0,0 +1,742 @@
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#include "eval_lib.h"
+#include "ast_lib.h"
+#include "sdm_lib.h"
+#include "token_lib.h"
+
+static bool is_literal(const AstNode *node) {
+  return node->kind == AST_NODE_INT || node->kind == AST_NODE_FLOAT;
+}
+
+static Value literal_value(const Ast *ast, const AstNode *node) {
+  Value value = {0};
+  if (node->kind == AST_NODE_INT) {
+    value.kind = VALUE_INT;
+    value.as.int_value = ast->ints.data[node->lhs];
+  } else {
+    value.kind = VALUE_FLOAT;
+    value.as.float_value = ast->floats.data[node->lhs];
+  }
+  return value;
+}
+
+const char *value_binary_op(uint8_t op, Value lhs, Value rhs, Value *result) {
+  // int (op) int stays an int, with / truncating; anything involving a float is a float
+  if (!value_is_number(lhs) || !value_is_number(rhs)) return "Arithmetic is only defined on numbers";
+
+  if (lhs.kind == VALUE_INT && rhs.kind == VALUE_INT) {
+    // Wrap on overflow rather than invoke undefined behaviour
+    uint64_t a = (uint64_t)lhs.as.int_value;
+    uint64_t b = (uint64_t)rhs.as.int_value;
+    result->kind = VALUE_INT;
+    switch (op) {
+      case TOKEN_TYPE_ADD:  result->as.int_value = (int64_t)(a + b); break;
+      case TOKEN_TYPE_SUB:  result->as.int_value = (int64_t)(a - b); break;
+      case TOKEN_TYPE_MULT: result->as.int_value = (int64_t)(a * b); break;
+      case TOKEN_TYPE_DIV:
+        if (b == 0) return "Integer division by zero";
+        if (lhs.as.int_value == INT64_MIN && rhs.as.int_value == -1) result->as.int_value = INT64_MIN;
+        else result->as.int_value = lhs.as.int_value / rhs.as.int_value;
+        break;
+      default: return "Unknown operator";
+    }
+    return NULL;
+  }
+
+  double a = value_as_float(lhs);
+  double b = value_as_float(rhs);
+  result->kind = VALUE_FLOAT;
+  switch (op) {
+    case TOKEN_TYPE_ADD:  result->as.float_value = a + b; break;
+    case TOKEN_TYPE_SUB:  result->as.float_value = a - b; break;
+    case TOKEN_TYPE_MULT: result->as.float_value = a * b; break;
+    case TOKEN_TYPE_DIV:  result->as.float_value = a / b; break;
+    default: return "Unknown operator";
+  }
+  return NULL;
+}
+
+const char *value_negate(Value value, Value *result) {
+  if (!value_is_number(value)) return "Arithmetic is only defined on numbers";
+  *result = value;
+  if (value.kind == VALUE_INT) result->as.int_value = (int64_t)(0 - (uint64_t)value.as.int_value);
+  else result->as.float_value = -value.as.float_value;
+  return NULL;
+}
+
+static void make_literal(Ast *ast, AstNode *node, Value value) {
+  if (value.kind == VALUE_INT) {
+    SDM_ARRAY_PUSH(ast->ints, value.as.int_value);
+    node->kind = AST_NODE_INT;
+    node->lhs = (uint32_t)(ast->ints.length - 1);
+  } else {
+    SDM_ARRAY_PUSH(ast->floats, value.as.float_value);
+    node->kind = AST_NODE_FLOAT;
+    node->lhs = (uint32_t)(ast->floats.length - 1);
+  }
+  node->op = 0;
+  node->rhs = 0;
+}
+
+// Bookkeeping for building the dependency graph in evaluator_init
+typedef struct {
+  uint32_t binding;         // Whose expression is being prepared, or EVAL_NO_BINDING
+  uint32_t *last_dependent; // The last binding recorded as depending on each binding
+  AstIndexArray edges;      // (dependency, dependent) pairs
+} DependencyBuilder;
+
+static void add_dependency(DependencyBuilder *builder, uint32_t dependency) {
+  if (builder->binding == EVAL_NO_BINDING || builder->last_dependent[dependency] == builder->binding) return;
+  builder->last_dependent[dependency] = builder->binding;
+  SDM_ARRAY_PUSH(builder->edges, dependency);
+  SDM_ARRAY_PUSH(builder->edges, builder->binding);
+}
+
+static void build_rows(DependencyBuilder *builder, size_t from, size_t binding_count, uint32_t *start, uint32_t *row) {
+  // Groups the edges by their from'th end (0 for the dependency, 1 for the dependent):
+  // count, prefix-sum, then fill.  Edges keep their order within a row.
+  AstIndexArray *edges = &builder->edges;
+  memset(start, 0, (binding_count + 1) * sizeof(uint32_t));
+  for (size_t i=0; i<edges->length; i+=2) {
+    start[edges->data[i + from] + 1]++;
+  }
+  for (size_t b=0; b<binding_count; b++) {
+    start[b + 1] += start[b];
+  }
+  // last_dependent is reused as the fill position of each row
+  memcpy(builder->last_dependent, start, binding_count * sizeof(uint32_t));
+  for (size_t i=0; i<edges->length; i+=2) {
+    row[builder->last_dependent[edges->data[i + from]]++] = edges->data[i + 1 - from];
+  }
+}
+
+static bool prepare_node(Evaluator *evaluator, DependencyBuilder *builder, uint32_t index) {
+  // Resolves identifiers below index and folds what can be folded, bottom up.  The
+  // folded node is overwritten with a literal; its old children are left unreferenced.
+  Ast *ast = evaluator->ast;
+  AstNode *node = &ast->nodes.data[index];
+
+  switch ((AstNodeKind)node->kind) {
+    case AST_NODE_INT:
+    case AST_NODE_FLOAT:
+    case AST_NODE_STRING:
+      return true;
+    case AST_NODE_IDENT: {
+      uint32_t binding = node->lhs < evaluator->symbol_capacity ? evaluator->binding_of_symbol[node->lhs] : EVAL_NO_BINDING;
+      if (binding == EVAL_NO_BINDING) {
+        ast_error(ast, node->offset, "'%s' is not defined", symbol_name(node->lhs).data);
+        return false;
+      }
+      node->rhs = binding;
+      add_dependency(builder, binding);
+      return true;
+    }
+    case AST_NODE_NEGATE: {
+      if (!prepare_node(evaluator, builder, node->lhs)) return false;
+      const AstNode *operand = &ast->nodes.data[node->lhs];
+      Value result;
+      if (is_literal(operand) && value_negate(literal_value(ast, operand), &result) == NULL) {
+        make_literal(ast, node, result);
+      }
+      return true;
+    }
+    case AST_NODE_BINARY: {
+      bool ok = prepare_node(evaluator, builder, node->lhs);
+      ok = prepare_node(evaluator, builder, node->rhs) && ok;
+      if (!ok) return false;
+      const AstNode *lhs = &ast->nodes.data[node->lhs];
+      const AstNode *rhs = &ast->nodes.data[node->rhs];
+      Value result;
+      // An integer division by zero is left for evaluation to report, if it's ever reached
+      if (is_literal(lhs) && is_literal(rhs) &&
+          value_binary_op(node->op, literal_value(ast, lhs), literal_value(ast, rhs), &result) == NULL) {
+        make_literal(ast, node, result);
+      }
+      return true;
+    }
+    case AST_NODE_CALL: {
+      AstCallArgs args = ast_call_args(ast, node);
+      bool ok = true;
+      for (uint32_t i=0; i<args.count; i++) {
+        ok = prepare_node(evaluator, builder, args.args[i]) && ok;
+      }
+      return ok;
+    }
+    case AST_NODE_NAMED_ARG:
+    case AST_NODE_LET:
+      return prepare_node(evaluator, builder, node->rhs);
+    case AST_NODE_EXPR_STMT:
+      return prepare_node(evaluator, builder, node->lhs);
+    case AST_NODE_KIND_COUNT:
+      break;
+  }
+  return false;
+}
+
+bool evaluator_init(Evaluator *evaluator, Ast *ast) {
+  memset(evaluator, 0, sizeof(*evaluator));
+  evaluator->ast = ast;
+
+  // Every name in the program was interned while it was lexed, so this covers them all
+  evaluator->symbol_capacity = symbol_count();
+  evaluator->binding_of_symbol = SDM_MALLOC(evaluator->symbol_capacity * sizeof(uint32_t));
+  if (evaluator->binding_of_symbol == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+  memset(evaluator->binding_of_symbol, 0xff, evaluator->symbol_capacity * sizeof(uint32_t));
+
+  bool ok = true;
+  for (size_t i=0; i<ast->statements.length; i++) {
+    uint32_t statement = ast->statements.data[i];
+    const AstNode *node = ast_node(ast, statement);
+    if (node->kind != AST_NODE_LET) continue;
+
+    if (evaluator->binding_of_symbol[node->lhs] != EVAL_NO_BINDING) {
+      ast_error(ast, node->offset, "'%s' is already defined", symbol_name(node->lhs).data);
+      ok = false;
+      continue;
+    }
+    Binding binding = {
+      .symbol = node->lhs,
+      .statement = statement,
+      .value = node->rhs,
+      .type = node->op,
+      .state = BINDING_UNEVALUATED,
+    };
+    evaluator->binding_of_symbol[node->lhs] = (uint32_t)evaluator->bindings.length;
+    SDM_ARRAY_PUSH(evaluator->bindings, binding);
+  }
+
+  size_t binding_count = evaluator->bindings.length;
+  DependencyBuilder builder = {0};
+  builder.last_dependent = SDM_MALLOC(binding_count * sizeof(uint32_t));
+  evaluator->dependent_start = SDM_MALLOC((binding_count + 1) * sizeof(uint32_t));
+  if (builder.last_dependent == NULL || evaluator->dependent_start == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+  memset(builder.last_dependent, 0xff, binding_count * sizeof(uint32_t));
+
+  for (size_t i=0; i<ast->statements.length; i++) {
+    uint32_t statement = ast->statements.data[i];
+    const AstNode *node = ast_node(ast, statement);
+    builder.binding = EVAL_NO_BINDING;
+    if (node->kind == AST_NODE_LET) {
+      uint32_t binding = evaluator->binding_of_symbol[node->lhs];
+      if (evaluator->bindings.data[binding].statement == statement) builder.binding = binding;
+    }
+    ok = prepare_node(evaluator, &builder, statement) && ok;
+  }
+
+  // Turn the edge list into compressed rows, once each way
+  evaluator->dependency_start = SDM_MALLOC((binding_count + 1) * sizeof(uint32_t));
+  evaluator->dependents = SDM_MALLOC(builder.edges.length / 2 * sizeof(uint32_t));
+  evaluator->dependencies = SDM_MALLOC(builder.edges.length / 2 * sizeof(uint32_t));
+  if (evaluator->dependency_start == NULL || evaluator->dependents == NULL || evaluator->dependencies == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+  build_rows(&builder, 0, binding_count, evaluator->dependent_start, evaluator->dependents);
+  build_rows(&builder, 1, binding_count, evaluator->dependency_start, evaluator->dependencies);
+
+  return ok;
+}
+
+uint32_t evaluator_find(const Evaluator *evaluator, sdm_string_view name) {
+  uint32_t symbol;
+  if (!find_symbol(name, &symbol) || symbol >= evaluator->symbol_capacity) return EVAL_NO_BINDING;
+  return evaluator->binding_of_symbol[symbol];
+}
+
+static bool check_type(Evaluator *evaluator, const Binding *binding, Value *value) {
+  switch (binding->type) {
+    case KEYWORD_INT:
+      if (value->kind == VALUE_INT) return true;
+      ast_error(evaluator->ast, ast_node(evaluator->ast, binding->value)->offset,
+                "'%s' is declared int but its value is not an integer", symbol_name(binding->symbol).data);
+      return false;
+    case KEYWORD_FLOAT:
+      if (!value_is_number(*value)) {
+        ast_error(evaluator->ast, ast_node(evaluator->ast, binding->value)->offset,
+                  "'%s' is declared float but its value is not a number", symbol_name(binding->symbol).data);
+        return false;
+      }
+      if (value->kind == VALUE_INT) {
+        value->kind = VALUE_FLOAT;
+        value->as.float_value = (double)value->as.int_value;
+      }
+      return true;
+    default:
+      // Elements and lines must be of the declared type
+      if ((value->kind == VALUE_ELEMENT || value->kind == VALUE_LINE) && VALUE_HANDLE_KIND(value->as.handle) == binding->type) return true;
+      ast_error(evaluator->ast, ast_node(evaluator->ast, binding->value)->offset,
+                "'%s' is declared %s but its value is not one", symbol_name(binding->symbol).data, keyword_name(binding->type));
+      return false;
+  }
+}
+
+static bool has_side_effects(const Evaluator *evaluator, uint32_t index) {
+  // Identifiers aren't followed: the bindings they name are scheduled on their own
+  const Ast *ast = evaluator->ast;
+  const AstNode *node = ast_node(ast, index);
+  switch ((AstNodeKind)node->kind) {
+    case AST_NODE_NEGATE:
+      return has_side_effects(evaluator, node->lhs);
+    case AST_NODE_BINARY:
+      return has_side_effects(evaluator, node->lhs) || has_side_effects(evaluator, node->rhs);
+    case AST_NODE_NAMED_ARG:
+      return has_side_effects(evaluator, node->rhs);
+    case AST_NODE_CALL: {
+      if (node->op == KEYWORD_NONE &&
+          (evaluator->call_is_pure == NULL || !evaluator->call_is_pure(evaluator->call_context, node))) {
+        return true;
+      }
+      AstCallArgs args = ast_call_args(ast, node);
+      for (uint32_t i=0; i<args.count; i++) {
+        if (has_side_effects(evaluator, args.args[i])) return true;
+      }
+      return false;
+    }
+    default:
+      return false;
+  }
+}
+
+static bool finish_binding(Evaluator *evaluator, Binding *binding) {
+  // The binding is already marked as being evaluated
+  Value result = {0};
+  bool ok = evaluate_expression(evaluator, binding->value, &result) && check_type(evaluator, binding, &result);
+  binding->state = ok ? BINDING_DONE : BINDING_FAILED;
+  binding->result = result;
+  return ok;
+}
+
+static bool walks_dependency(const Evaluator *evaluator, uint32_t binding) {
+  // Bindings with side effects are left for the expressions naming them to reach, so
+  // that they run in the same order as they would without the walk
+  const Binding *dependency = &evaluator->bindings.data[binding];
+  return dependency->state == BINDING_UNEVALUATED && !has_side_effects(evaluator, dependency->value);
+}
+
+bool evaluate_binding(Evaluator *evaluator, uint32_t index, Value *value) {
+  Binding *bindings = evaluator->bindings.data;
+  switch ((BindingState)bindings[index].state) {
+    case BINDING_DONE:
+      *value = bindings[index].result;
+      return true;
+    case BINDING_FAILED:
+    case BINDING_EVALUATING:
+      // Whoever reached an evaluating binding has already reported the cycle
+      return false;
+    case BINDING_UNEVALUATED:
+      break;
+  }
+  bindings[index].state = BINDING_EVALUATING;
+
+  // Evaluating an identifier evaluates the binding it names, so a long chain of bindings
+  // would recurse once per link.  Instead, when this binding's own expression has no side
+  // effects, what it names is evaluated first, depth first from an explicit stack, so that
+  // each expression only meets finished bindings.  A binding's dependencies are looked at in
+  // the order its expression names them, and the walk stops at the first one that failed,
+  // is being evaluated (a cycle) or has side effects: the expression reaches that one itself.
+  uint32_t count;
+  const uint32_t *dependencies = evaluator_dependencies(evaluator, index, &count);
+  uint32_t first = 0;
+  while (first < count && bindings[dependencies[first]].state == BINDING_DONE) first++;
+  if (first < count && !has_side_effects(evaluator, bindings[index].value) && walks_dependency(evaluator, dependencies[first])) {
+    // Frames are a binding and the position of the dependency being evaluated.  The expression
+    // finished at each pop can come back here, so frames go above whatever is on the stack.
+    // Pool workers never get this far: they are only handed bindings whose dependencies are done.
+    AstIndexArray *stack = &evaluator->stack;
+    size_t base = stack->length;
+    SDM_ARRAY_PUSH(*stack, index);
+    SDM_ARRAY_PUSH(*stack, first);
+    while (stack->length > base) {
+      uint32_t binding = stack->data[stack->length - 2];
+      uint32_t next = stack->data[stack->length - 1];
+      dependencies = evaluator_dependencies(evaluator, binding, &count);
+      while (next < count && bindings[dependencies[next]].state == BINDING_DONE) next++;
+      if (next < count && walks_dependency(evaluator, dependencies[next])) {
+        stack->data[stack->length - 1] = next;
+        bindings[dependencies[next]].state = BINDING_EVALUATING;
+        SDM_ARRAY_PUSH(*stack, dependencies[next]);
+        SDM_ARRAY_PUSH(*stack, 0);
+        continue;
+      }
+      stack->length -= 2;
+      if (stack->length > base) finish_binding(evaluator, &bindings[binding]);
+    }
+  }
+
+  bool ok = finish_binding(evaluator, &bindings[index]);
+  *value = bindings[index].result;
+  return ok;
+}
+
+void evaluator_invalidate(Evaluator *evaluator, uint32_t binding) {
+  // Depth first over the dependents.  A binding that is already unevaluated is not
+  // descended into: nothing that depends on it can hold a computed value.
+  BindingArray *bindings = &evaluator->bindings;
+  bindings->data[binding].state = BINDING_UNEVALUATED;
+  bindings->data[binding].overridden = false;
+
+  AstIndexArray *stack = &evaluator->stack;
+  stack->length = 0;
+  SDM_ARRAY_PUSH(*stack, binding);
+  while (stack->length > 0) {
+    uint32_t count;
+    const uint32_t *dependents = evaluator_dependents(evaluator, stack->data[--stack->length], &count);
+    for (uint32_t i=0; i<count; i++) {
+      Binding *dependent = &bindings->data[dependents[i]];
+      if (dependent->state == BINDING_UNEVALUATED || dependent->overridden) continue;
+      dependent->state = BINDING_UNEVALUATED;
+      SDM_ARRAY_PUSH(*stack, dependents[i]);
+    }
+  }
+}
+
+bool evaluator_override(Evaluator *evaluator, uint32_t index, Value value) {
+  Binding *binding = &evaluator->bindings.data[index];
+  if (!check_type(evaluator, binding, &value)) return false;
+  evaluator_invalidate(evaluator, index);
+  binding->result = value;
+  binding->state = BINDING_DONE;
+  binding->overridden = true;
+  return true;
+}
+
+#define EVAL_WORKER_ARENA_CAP (1024 * 1024)
+// A worker that finds nothing to do yields this many times, then sleeps between
+// attempts so that idle workers don't hold a core while others finish a long binding
+#define EVAL_IDLE_YIELDS 64
+#define EVAL_IDLE_SLEEP_NS 50000
+
+typedef struct {
+  Evaluator *evaluator;
+  sdm_ws_deque *deques;
+  size_t worker_count;
+  _Atomic uint32_t *pending;  // Dependencies of each binding not yet evaluated by the pool
+  size_t schedulable;         // How many bindings the pool will evaluate
+  _Atomic size_t completed;
+  _Atomic bool failed;
+  const bool *wanted;         // Which bindings the pool may evaluate, or NULL for all of them
+  bool quiet;                 // Errors aren't reported
+} EvalPool;
+
+typedef struct {
+  EvalPool *pool;
+  size_t id;
+} EvalWorker;
+
+static bool pool_takes(const EvalPool *pool, uint32_t binding) {
+  return !pool->evaluator->bindings.data[binding].sequential && (pool->wanted == NULL || pool->wanted[binding]);
+}
+
+static bool take_work(EvalPool *pool, size_t id, uint32_t *binding) {
+  if (sdm_ws_deque_take(&pool->deques[id], binding)) return true;
+  for (size_t i=1; i<pool->worker_count; i++) {
+    if (sdm_ws_deque_steal(&pool->deques[(id + i) % pool->worker_count], binding)) return true;
+  }
+  return false;
+}
+
+static int run_worker(void *arg) {
+  EvalWorker *worker = arg;
+  EvalPool *pool = worker->pool;
+  Evaluator *evaluator = pool->evaluator;
+  sdm_arena_t *previous = active_swap_arena(&evaluator->worker_arenas[worker->id]);
+  if (pool->quiet) ast_mute_errors(true);
+
+  uint32_t idle = 0;
+  while (atomic_load_explicit(&pool->completed, memory_order_acquire) < pool->schedulable) {
+    uint32_t binding;
+    if (!take_work(pool, worker->id, &binding)) {
+      if (idle < EVAL_IDLE_YIELDS) {
+        idle++;
+        thrd_yield();
+      } else {
+        thrd_sleep(&(struct timespec){ .tv_nsec = EVAL_IDLE_SLEEP_NS }, NULL);
+      }
+      continue;
+    }
+    idle = 0;
+
+    // Everything this depends on is done, so this doesn't recurse
+    Value value;
+    if (!evaluate_binding(evaluator, binding, &value)) atomic_store(&pool->failed, true);
+
+    uint32_t count;
+    const uint32_t *dependents = evaluator_dependents(evaluator, binding, &count);
+    for (uint32_t i=0; i<count; i++) {
+      uint32_t dependent = dependents[i];
+      if (atomic_fetch_sub_explicit(&pool->pending[dependent], 1, memory_order_acq_rel) == 1 &&
+          pool_takes(pool, dependent)) {
+        sdm_ws_deque_push(&pool->deques[worker->id], dependent);
+      }
+    }
+    atomic_fetch_add_explicit(&pool->completed, 1, memory_order_release);
+  }
+
+  if (pool->quiet) ast_mute_errors(false);
+  active_swap_arena(previous);
+  return 0;
+}
+
+static bool evaluate_in_parallel(Evaluator *evaluator, size_t thread_count, const bool *wanted, bool quiet) {
+  size_t binding_count = evaluator->bindings.length;
+  Binding *bindings = evaluator->bindings.data;
+  for (size_t b=0; b<binding_count; b++) {
+    bindings[b].sequential = has_side_effects(evaluator, bindings[b].value);
+  }
+
+  if (evaluator->worker_count < thread_count) {
+    sdm_arena_t *arenas = SDM_MALLOC(thread_count * sizeof(sdm_arena_t));
+    if (arenas == NULL) {
+      fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+      exit(1);
+    }
+    memset(arenas, 0, thread_count * sizeof(sdm_arena_t));
+    if (evaluator->worker_count > 0) memcpy(arenas, evaluator->worker_arenas, evaluator->worker_count * sizeof(sdm_arena_t));
+    for (size_t i=evaluator->worker_count; i<thread_count; i++) arenas[i].capacity = EVAL_WORKER_ARENA_CAP;
+    evaluator->worker_arenas = arenas;
+    evaluator->worker_count = thread_count;
+  }
+
+  EvalPool pool = {
+    .evaluator = evaluator,
+    .worker_count = thread_count,
+    .wanted = wanted,
+    .quiet = quiet,
+  };
+  pool.pending = SDM_MALLOC(binding_count * sizeof(pool.pending[0]));
+  pool.deques = SDM_MALLOC(thread_count * sizeof(pool.deques[0]));
+  uint32_t *remaining = SDM_MALLOC(binding_count * sizeof(uint32_t));
+  uint32_t *order = SDM_MALLOC(binding_count * sizeof(uint32_t));
+  if (pool.pending == NULL || pool.deques == NULL || remaining == NULL || order == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+
+  memset(remaining, 0, binding_count * sizeof(uint32_t));
+  for (size_t i=0; i<evaluator->dependent_start[binding_count]; i++) {
+    remaining[evaluator->dependents[i]]++;
+  }
+  for (size_t b=0; b<binding_count; b++) atomic_init(&pool.pending[b], remaining[b]);
+
+  // Work out up front how many bindings the pool will get to (everything it is allowed
+  // except sequential bindings, cycles and whatever depends on them), so that the workers
+  // know when to stop.  The bindings that are ready straight away come first in order.
+  size_t ready = 0;
+  for (size_t b=0; b<binding_count; b++) {
+    if (remaining[b] == 0 && pool_takes(&pool, (uint32_t)b)) order[ready++] = (uint32_t)b;
+  }
+  size_t initial = ready;
+  for (size_t i=0; i<ready; i++) {
+    uint32_t count;
+    const uint32_t *dependents = evaluator_dependents(evaluator, order[i], &count);
+    for (uint32_t j=0; j<count; j++) {
+      if (--remaining[dependents[j]] == 0 && pool_takes(&pool, dependents[j])) order[ready++] = dependents[j];
+    }
+  }
+  pool.schedulable = ready;
+  atomic_init(&pool.completed, 0);
+  atomic_init(&pool.failed, false);
+
+  for (size_t i=0; i<thread_count; i++) {
+    sdm_ws_deque_init(&pool.deques[i], ready);
+  }
+  for (size_t i=0; i<initial; i++) {
+    sdm_ws_deque_push(&pool.deques[i % thread_count], order[i]);
+  }
+
+  // The calling thread is worker 0
+  EvalWorker *workers = SDM_MALLOC(thread_count * sizeof(EvalWorker));
+  thrd_t *threads = SDM_MALLOC(thread_count * sizeof(thrd_t));
+  if (workers == NULL || threads == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+  size_t started = 1;
+  for (size_t i=0; i<thread_count; i++) workers[i] = (EvalWorker){ .pool = &pool, .id = i };
+  for (; started<thread_count; started++) {
+    if (thrd_create(&threads[started], run_worker, &workers[started]) != thrd_success) break;
+  }
+  if (started < thread_count) {
+    // Whatever the missing workers would have picked up gets stolen by the others
+    fprintf(stderr, "WARNING: Only started %zu of %zu evaluation threads\n", started, thread_count);
+  }
+  run_worker(&workers[0]);
+  for (size_t i=1; i<started; i++) thrd_join(threads[i], NULL);
+
+  return !atomic_load(&pool.failed);
+}
+
+bool evaluate_all(Evaluator *evaluator, size_t thread_count) {
+  bool ok = true;
+  if (thread_count > 1 && evaluator->bindings.length > 0) ok = evaluate_in_parallel(evaluator, thread_count, NULL, false);
+
+  // Whatever the pool didn't reach, in source order
+  for (uint32_t b=0; b<evaluator->bindings.length; b++) {
+    Value value;
+    ok = evaluate_binding(evaluator, b, &value) && ok;
+  }
+  return ok;
+}
+
+static void mark_named(const Evaluator *evaluator, uint32_t index, bool *reached, AstIndexArray *found) {
+  const Ast *ast = evaluator->ast;
+  const AstNode *node = ast_node(ast, index);
+  switch ((AstNodeKind)node->kind) {
+    case AST_NODE_IDENT:
+      if (!reached[node->rhs]) {
+        reached[node->rhs] = true;
+        SDM_ARRAY_PUSH(*found, node->rhs);
+      }
+      break;
+    case AST_NODE_NEGATE:
+    case AST_NODE_EXPR_STMT:
+      mark_named(evaluator, node->lhs, reached, found);
+      break;
+    case AST_NODE_BINARY:
+      mark_named(evaluator, node->lhs, reached, found);
+      mark_named(evaluator, node->rhs, reached, found);
+      break;
+    case AST_NODE_NAMED_ARG:
+      mark_named(evaluator, node->rhs, reached, found);
+      break;
+    case AST_NODE_CALL: {
+      AstCallArgs args = ast_call_args(ast, node);
+      for (uint32_t i=0; i<args.count; i++) mark_named(evaluator, args.args[i], reached, found);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+void evaluate_reachable(Evaluator *evaluator, size_t thread_count) {
+  size_t binding_count = evaluator->bindings.length;
+  if (thread_count <= 1 || binding_count == 0) return;
+
+  // What the statements outside the bindings name, and everything that names in turn
+  const Ast *ast = evaluator->ast;
+  bool *reached = SDM_MALLOC(binding_count * sizeof(bool));
+  if (reached == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+  memset(reached, 0, binding_count * sizeof(bool));
+  AstIndexArray *found = &evaluator->stack;
+  found->length = 0;
+  for (size_t i=0; i<ast->statements.length; i++) {
+    if (ast_node(ast, ast->statements.data[i])->kind == AST_NODE_EXPR_STMT) {
+      mark_named(evaluator, ast->statements.data[i], reached, found);
+    }
+  }
+  while (found->length > 0) {
+    uint32_t count;
+    const uint32_t *dependencies = evaluator_dependencies(evaluator, found->data[--found->length], &count);
+    for (uint32_t i=0; i<count; i++) {
+      if (!reached[dependencies[i]]) {
+        reached[dependencies[i]] = true;
+        SDM_ARRAY_PUSH(*found, dependencies[i]);
+      }
+    }
+  }
+
+  // Failures were kept quiet, so they are undone to be evaluated, and reported, again
+  // when the program gets to them
+  evaluate_in_parallel(evaluator, thread_count, reached, true);
+  for (size_t b=0; b<binding_count; b++) {
+    if (evaluator->bindings.data[b].state == BINDING_FAILED) evaluator->bindings.data[b].state = BINDING_UNEVALUATED;
+  }
+}
+
+void evaluator_free(Evaluator *evaluator) {
+  for (size_t i=0; i<evaluator->worker_count; i++) {
+    sdm_arena_free(&evaluator->worker_arenas[i]);
+  }
+  evaluator->worker_arenas = NULL;
+  evaluator->worker_count = 0;
+}
+
+bool evaluate_expression(Evaluator *evaluator, uint32_t index, Value *value) {
+  const Ast *ast = evaluator->ast;
+  const AstNode *node = ast_node(ast, index);
+
+  switch ((AstNodeKind)node->kind) {
+    case AST_NODE_INT:
+    case AST_NODE_FLOAT:
+      *value = literal_value(ast, node);
+      return true;
+    case AST_NODE_IDENT:
+      if (evaluator->bindings.data[node->rhs].state == BINDING_EVALUATING) {
+        ast_error(ast, node->offset, "'%s' is defined in terms of itself", symbol_name(node->lhs).data);
+        return false;
+      }
+      return evaluate_binding(evaluator, node->rhs, value);
+    case AST_NODE_STRING:
+      value->kind = VALUE_STRING;
+      value->as.string_value = ast->strings.data[node->lhs];
+      return true;
+    case AST_NODE_NEGATE: {
+      Value operand;
+      if (!evaluate_expression(evaluator, node->lhs, &operand)) return false;
+      const char *error = value_negate(operand, value);
+      if (error != NULL) {
+        ast_error(ast, node->offset, "%s", error);
+        return false;
+      }
+      return true;
+    }
+    case AST_NODE_BINARY: {
+      Value lhs, rhs;
+      if (!evaluate_expression(evaluator, node->lhs, &lhs)) return false;
+      if (!evaluate_expression(evaluator, node->rhs, &rhs)) return false;
+      const char *error = value_binary_op(node->op, lhs, rhs, value);
+      if (error != NULL) {
+        ast_error(ast, node->offset, "%s", error);
+        return false;
+      }
+      return true;
+    }
+    case AST_NODE_CALL: {
+      if (node->op != KEYWORD_NONE && evaluator->construct != NULL) {
+        return evaluator->construct(evaluator->construct_context, index, value);
+      }
+      AstCallArgs args = ast_call_args(ast, node);
+      if (node->op != KEYWORD_NONE || evaluator->call == NULL) {
+        const char *callee = node->op == KEYWORD_NONE ? symbol_name(node->lhs).data : keyword_name(node->op);
+        ast_error(ast, node->offset, "Can't evaluate a call to %s", callee);
+        return false;
+      }
+      if (args.count > EVAL_MAX_CALL_ARGS) {
+        ast_error(ast, node->offset, "Too many arguments (the limit is %d)", EVAL_MAX_CALL_ARGS);
+        return false;
+      }
+      Value values[EVAL_MAX_CALL_ARGS];
+      for (uint32_t i=0; i<args.count; i++) {
+        const AstNode *arg = ast_node(ast, args.args[i]);
+        if (arg->kind == AST_NODE_NAMED_ARG) {
+          ast_error(ast, arg->offset, "Named arguments can only be given to constructors");
+          return false;
+        }
+        if (!evaluate_expression(evaluator, args.args[i], &values[i])) return false;
+      }
+      return evaluator->call(evaluator->call_context, node, values, args.count, value);
+    }
+    case AST_NODE_NAMED_ARG:
+    case AST_NODE_LET:
+    case AST_NODE_EXPR_STMT:
+    case AST_NODE_KIND_COUNT:
+      break;
+  }
+
+  ast_error(ast, node->offset, "Not an expression");
+  return false;
+}
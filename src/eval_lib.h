@@ -0,0 +1,158 @@
+#ifndef _EVAL_LIB_H
+#define _EVAL_LIB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ast_lib.h"
+
+typedef enum {
+  VALUE_NONE = 0,
+  VALUE_INT,
+  VALUE_FLOAT,
+  VALUE_STRING,
+  VALUE_ELEMENT,  // as.handle
+  VALUE_LINE,     // as.handle
+} ValueKind;
+
+// Elements and lines are referred to by a handle holding the KeywordKind of their
+// type in the top byte and an index in the rest
+#define VALUE_HANDLE(kind, index) (((uint32_t)(kind) << 24) | (uint32_t)(index))
+#define VALUE_HANDLE_KIND(handle) ((KeywordKind)((handle) >> 24))
+#define VALUE_HANDLE_INDEX(handle) ((handle) & 0xffffffu)
+#define VALUE_HANDLE_MAX_INDEX 0xffffffu
+
+typedef struct {
+  ValueKind kind;
+  union {
+    int64_t int_value;
+    double float_value;
+    sdm_string_view string_value;
+    uint32_t handle;
+  } as;
+} Value;
+
+typedef enum {
+  BINDING_UNEVALUATED = 0,
+  BINDING_EVALUATING,  // On the evaluation stack; meeting it again means a cycle
+  BINDING_DONE,
+  BINDING_FAILED,
+} BindingState;
+
+// One per `let` statement.  The value is worked out the first time it is asked for
+// and kept from then on.
+typedef struct {
+  uint32_t symbol;
+  uint32_t statement;  // The LET node
+  uint32_t value;      // The node of its expression
+  uint8_t type;        // KeywordKind of the declared type
+  uint8_t state;       // BindingState
+  bool overridden;     // result was set by evaluator_override, not computed
+  bool sequential;     // Calls a function with side effects, so is never run on a worker thread; set by the pool
+  Value result;
+} Binding;
+
+typedef struct {
+  size_t capacity;
+  size_t length;
+  Binding *data;
+} BindingArray;
+
+#define EVAL_NO_BINDING UINT32_MAX
+#define EVAL_MAX_CALL_ARGS 32
+
+// Called to evaluate a call to a named function (constructors aside).  It is given
+// the CALL node for error reporting and returns false once it has reported a failure.
+typedef bool (*EvalCallFunction)(void *context, const AstNode *call, const Value *args, uint32_t count, Value *result);
+// Says whether a call to a named function is free of side effects, and so may be
+// evaluated on a worker thread.  It is given the same context as the call function.
+typedef bool (*EvalPureFunction)(void *context, const AstNode *call);
+// Called to evaluate a constructor such as Drift(L = 1.0) or Line(...).  It is given
+// the CALL node's index, as it may need to look at the arguments' syntax.
+typedef bool (*EvalConstructFunction)(void *context, uint32_t call, Value *result);
+
+// Identifiers are resolved once, when the evaluator is set up: each IDENT node's rhs
+// is set to the index of the binding it names, so evaluation never looks a name up.
+typedef struct {
+  Ast *ast;
+  BindingArray bindings;
+  uint32_t *binding_of_symbol;  // Indexed by symbol id; EVAL_NO_BINDING if the symbol isn't bound
+  size_t symbol_capacity;
+  EvalCallFunction call;        // If NULL, calls can't be evaluated
+  void *call_context;
+  EvalPureFunction call_is_pure;  // If NULL, every call is taken to have side effects
+  EvalConstructFunction construct;  // If NULL, constructors can't be evaluated
+  void *construct_context;
+
+  // The bindings whose expressions name binding b directly are
+  // dependents[dependent_start[b] .. dependent_start[b + 1]], and the bindings b's
+  // expression names are dependencies[dependency_start[b] .. dependency_start[b + 1]],
+  // in the order the expression first names them
+  uint32_t *dependent_start;
+  uint32_t *dependents;
+  uint32_t *dependency_start;
+  uint32_t *dependencies;
+  AstIndexArray stack;          // Scratch space for evaluate_binding and evaluator_invalidate
+
+  sdm_arena_t *worker_arenas;   // One per pool thread, kept until evaluator_free
+  size_t worker_count;
+} Evaluator;
+
+// Collects the program's bindings, resolves every identifier and folds subexpressions
+// that only involve literals.  Returns false (after reporting) on an unknown or
+// repeated name.
+bool evaluator_init(Evaluator *evaluator, Ast *ast);
+uint32_t evaluator_find(const Evaluator *evaluator, sdm_string_view name);
+bool evaluate_binding(Evaluator *evaluator, uint32_t binding, Value *value);
+bool evaluate_expression(Evaluator *evaluator, uint32_t node, Value *value);
+
+// Evaluates every binding, returning false if any of them fails.  With more than one
+// thread, bindings are run on a work-stealing pool as soon as everything they depend
+// on is done, each thread allocating from its own arena.  Bindings that call
+// functions with side effects (such as println), and those that depend on them, are
+// then evaluated on the calling thread in source order, as are any caught in a cycle.  Each result ends up in its
+// own binding, so the results don't depend on the thread count; only the order of
+// error messages from the pool can differ between runs.
+bool evaluate_all(Evaluator *evaluator, size_t thread_count);
+// Evaluates ahead of time, on a pool of thread_count threads, the bindings without side
+// effects that the program's statements name, directly or through other bindings.
+// Nothing is reported from the pool: a binding that fails there is evaluated again,
+// and reports its error, when it is first asked for.  So the program prints the same
+// with or without this, only sooner.
+void evaluate_reachable(Evaluator *evaluator, size_t thread_count);
+void evaluator_free(Evaluator *evaluator);
+
+// Marks a binding, and everything that depends on it, as needing to be evaluated
+// again; nothing is recomputed until it is next asked for.  Any override on the
+// binding itself is dropped.  Overridden dependents keep their values, and so stop
+// the invalidation from spreading past them.
+void evaluator_invalidate(Evaluator *evaluator, uint32_t binding);
+// Replaces a binding's value, e.g. while tuning, and invalidates its dependents.
+// Returns false if the value doesn't match the declared type.
+bool evaluator_override(Evaluator *evaluator, uint32_t binding, Value value);
+
+static inline const uint32_t *evaluator_dependents(const Evaluator *evaluator, uint32_t binding, uint32_t *count) {
+  *count = evaluator->dependent_start[binding + 1] - evaluator->dependent_start[binding];
+  return &evaluator->dependents[evaluator->dependent_start[binding]];
+}
+
+static inline const uint32_t *evaluator_dependencies(const Evaluator *evaluator, uint32_t binding, uint32_t *count) {
+  *count = evaluator->dependency_start[binding + 1] - evaluator->dependency_start[binding];
+  return &evaluator->dependencies[evaluator->dependency_start[binding]];
+}
+
+// Arithmetic shared by the evaluator and the VM.  These return NULL on success, or a
+// description of what went wrong.
+const char *value_binary_op(uint8_t op, Value lhs, Value rhs, Value *result);
+const char *value_negate(Value value, Value *result);
+
+static inline bool value_is_number(Value value) {
+  return value.kind == VALUE_INT || value.kind == VALUE_FLOAT;
+}
+
+static inline double value_as_float(Value value) {
+  return value.kind == VALUE_INT ? (double)value.as.int_value : value.as.float_value;
+}
+
+#endif // !_EVAL_LIB_H
+
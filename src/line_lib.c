@@ -0,0 +1,435 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include "line_lib.h"
+#include "ast_lib.h"
+#include "eval_lib.h"
+#include "sdm_lib.h"
+#include "token_lib.h"
+
+#define LATTICE_ARENA_CAP (256 * 1024)
+// Lines with up to this many items are put together on the stack
+#define LINE_STACK_ITEMS 32
+
+// What the schema says about each kind: where its table is, and for each parameter
+// it takes, where that column is, what it defaults to and what it adds to the sums
+typedef struct {
+  bool present;
+  size_t column;  // Offset of the column's pointer in the table
+  double default_value;
+  ElementSum sum;
+} ElementSlot;
+
+typedef struct {
+  size_t table;   // Offset of the table in Lattice
+  ElementSlot slots[ELEMENT_PARAM_COUNT];
+} ElementKind;
+
+#define ELEMENT_SLOT(type, name, default, sum) [ELEMENT_PARAM_##name] = { true, offsetof(type##Table, name), default, ELEMENT_SUM_##sum },
+static const ElementKind element_kinds[KEYWORD_COUNT] = {
+#define X(keyword, type, table, params) [KEYWORD_##keyword] = { offsetof(Lattice, table), { params(ELEMENT_SLOT, type) } },
+  ELEMENT_KINDS(X)
+#undef X
+};
+#undef ELEMENT_SLOT
+
+// ElementParam + 1 by the hash of its name, 0 for an empty slot
+static const uint8_t element_param_table[ELEMENT_PARAM_TABLE_SIZE] = {
+#define X(name, first, last) [ELEMENT_PARAM_HASH(sizeof(#name) - 1, first, last)] = ELEMENT_PARAM_##name + 1,
+  ELEMENT_PARAM_LIST(X)
+#undef X
+};
+
+static const char *element_param_names[ELEMENT_PARAM_COUNT] = {
+#define X(name, first, last) [ELEMENT_PARAM_##name] = #name,
+  ELEMENT_PARAM_LIST(X)
+#undef X
+};
+
+static bool is_element_kind(uint8_t kind) {
+  switch (kind) {
+#define X(keyword, type, table, params) case KEYWORD_##keyword:
+    ELEMENT_KINDS(X)
+#undef X
+      return true;
+    default:
+      return false;
+  }
+}
+
+static double *element_column(const Lattice *lattice, KeywordKind kind, uint32_t param) {
+  const ElementKind *info = &element_kinds[kind];
+  return *(double *const *)((const char*)lattice + info->table + info->slots[param].column);
+}
+
+static uint8_t find_param(const Lattice *lattice, uint32_t symbol) {
+  // The hash picks the only parameter the name could be; the symbols then say
+  // whether it is, with no need to compare strings
+  sdm_string_view name = symbol_name(symbol);
+  if (name.length == 0) return ELEMENT_NO_PARAM;
+  uint8_t entry = element_param_table[ELEMENT_PARAM_HASH(name.length, name.data[0], name.data[name.length - 1])];
+  if (entry == 0 || lattice->param_symbols[entry - 1] != symbol) return ELEMENT_NO_PARAM;
+  return entry - 1;
+}
+
+static bool bind_element_args(Lattice *lattice, const AstNode *call) {
+  Ast *ast = lattice->evaluator->ast;
+  KeywordKind kind = call->op;
+  AstCallArgs args = ast_call_args(ast, call);
+  bool given[ELEMENT_PARAM_COUNT] = {0};
+  bool ok = true;
+  for (uint32_t i=0; i<args.count; i++) {
+    AstNode *arg = &ast->nodes.data[args.args[i]];
+    if (arg->kind != AST_NODE_NAMED_ARG) {
+      ast_error(ast, arg->offset, "The arguments of %s must be named, as in L = 1.0", keyword_name(kind));
+      ok = false;
+      continue;
+    }
+    uint8_t param = find_param(lattice, arg->lhs);
+    arg->op = ELEMENT_NO_PARAM;
+    if (param == ELEMENT_NO_PARAM || !element_kinds[kind].slots[param].present) {
+      ast_error(ast, arg->offset, "%s has no argument '%s'", keyword_name(kind), symbol_name(arg->lhs).data);
+      ok = false;
+    } else if (given[param]) {
+      ast_error(ast, arg->offset, "'%s' is given more than once", symbol_name(arg->lhs).data);
+      ok = false;
+    } else {
+      given[param] = true;
+      arg->op = param;
+    }
+  }
+  return ok;
+}
+
+static bool construct_element(Lattice *lattice, const AstNode *call, Value *result) {
+  Evaluator *evaluator = lattice->evaluator;
+  const Ast *ast = evaluator->ast;
+  KeywordKind kind = call->op;
+  const ElementKind *info = &element_kinds[kind];
+  AstCallArgs args = ast_call_args(ast, call);
+
+  // Nothing is written until every argument has been evaluated
+  double values[ELEMENT_PARAM_COUNT];
+  for (uint32_t p=0; p<ELEMENT_PARAM_COUNT; p++) values[p] = info->slots[p].default_value;
+  for (uint32_t i=0; i<args.count; i++) {
+    const AstNode *arg = ast_node(ast, args.args[i]);
+    // lattice_init has already reported any argument it couldn't bind
+    if (arg->kind != AST_NODE_NAMED_ARG || arg->op == ELEMENT_NO_PARAM) return false;
+    Value value;
+    if (!evaluate_expression(evaluator, arg->rhs, &value)) return false;
+    if (!value_is_number(value)) {
+      ast_error(ast, ast_node(ast, arg->rhs)->offset, "'%s' must be a number", element_param_names[arg->op]);
+      return false;
+    }
+    values[arg->op] = value_as_float(value);
+  }
+
+  // Each call site has its own row, allocated up front, so this needs no lock
+  uint32_t row = call->lhs;
+  for (uint32_t p=0; p<ELEMENT_PARAM_COUNT; p++) {
+    if (info->slots[p].present) element_column(lattice, kind, p)[row] = values[p];
+  }
+
+  result->kind = VALUE_ELEMENT;
+  result->as.handle = VALUE_HANDLE(kind, row);
+  return true;
+}
+
+static bool line_item(Evaluator *evaluator, uint32_t index, LineItem *item) {
+  // -x and 2 * x aren't arithmetic on lines, so reversal and repetition are read
+  // from the syntax of the argument rather than by evaluating it
+  const Ast *ast = evaluator->ast;
+  const AstNode *node = ast_node(ast, index);
+
+  if (node->kind == AST_NODE_NEGATE) {
+    if (!line_item(evaluator, node->lhs, item)) return false;
+    item->flags ^= LINE_ITEM_REVERSED;
+    return true;
+  }
+  if (node->kind == AST_NODE_BINARY && node->op == TOKEN_TYPE_MULT) {
+    Value count;
+    if (!evaluate_expression(evaluator, node->lhs, &count)) return false;
+    if (count.kind != VALUE_INT || count.as.int_value < 1) {
+      ast_error(ast, node->offset, "A repeat count must be a positive integer, before the '*' as in 2 * cell");
+      return false;
+    }
+    if (!line_item(evaluator, node->rhs, item)) return false;
+    uint64_t repeat = (uint64_t)item->repeat * (uint64_t)count.as.int_value;
+    if (count.as.int_value > (int64_t)UINT32_MAX || repeat > UINT32_MAX) {
+      ast_error(ast, node->offset, "Too many repeats (the limit is %u)", UINT32_MAX);
+      return false;
+    }
+    item->repeat = (uint32_t)repeat;
+    return true;
+  }
+  if (node->kind == AST_NODE_NAMED_ARG) {
+    ast_error(ast, node->offset, "Line doesn't take named arguments");
+    return false;
+  }
+
+  Value value;
+  if (!evaluate_expression(evaluator, index, &value)) return false;
+  if (value.kind != VALUE_ELEMENT && value.kind != VALUE_LINE) {
+    ast_error(ast, node->offset, "A line can only hold elements and other lines");
+    return false;
+  }
+  *item = (LineItem){ .target = value.as.handle, .repeat = 1, .flags = 0 };
+  return true;
+}
+
+static bool intern_line(Lattice *lattice, const AstNode *call, const LineItem *items, uint32_t count) {
+  mtx_lock(&lattice->lock);
+  uint32_t depth = 1;
+  for (uint32_t i=0; i<count; i++) {
+    if (VALUE_HANDLE_KIND(items[i].target) != KEYWORD_LINE) continue;
+    uint32_t below = lattice_line(lattice, items[i].target)->depth + 1;
+    if (below > depth) depth = below;
+  }
+  if (depth > LINE_MAX_DEPTH) {
+    mtx_unlock(&lattice->lock);
+    ast_error(lattice->evaluator->ast, call->offset, "Lines are nested too deeply (the limit is %d)", LINE_MAX_DEPTH);
+    return false;
+  }
+
+  // LineItem has no padding, so equal item lists are equal as bytes
+  sdm_arena_t *previous = active_swap_arena(&lattice->arena);
+  sdm_string_view key = sdm_sized_str_as_sv((char*)items, count * sizeof(LineItem));
+  uint32_t list = sdm_intern(&lattice->item_lists, key, sdm_hash_bytes(key.data, key.length));
+  Line *line = &lattice->lines[call->lhs];
+  line->items = (const LineItem*)sdm_interned_name(&lattice->item_lists, list).data;
+  line->item_count = count;
+  line->depth = depth;
+  line->summed = false;
+  active_swap_arena(previous);
+  mtx_unlock(&lattice->lock);
+  return true;
+}
+
+static bool construct_line(Lattice *lattice, const AstNode *call, Value *result) {
+  Evaluator *evaluator = lattice->evaluator;
+  AstCallArgs args = ast_call_args(evaluator->ast, call);
+
+  // The items are only needed until sdm_intern has copied them.  Most lines fit on the
+  // stack; longer ones go on the heap rather than into an arena, where they'd stay.
+  LineItem buffer[LINE_STACK_ITEMS];
+  LineItem *items = buffer;
+  if (args.count > LINE_STACK_ITEMS) {
+    items = malloc(args.count * sizeof(LineItem));
+    if (items == NULL) {
+      fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+      exit(1);
+    }
+  }
+
+  bool ok = true;
+  for (uint32_t i=0; ok && i<args.count; i++) {
+    ok = line_item(evaluator, args.args[i], &items[i]);
+  }
+  ok = ok && intern_line(lattice, call, items, args.count);
+  if (items != buffer) free(items);
+  if (!ok) return false;
+
+  result->kind = VALUE_LINE;
+  result->as.handle = VALUE_HANDLE(KEYWORD_LINE, call->lhs);
+  return true;
+}
+
+static LineSums element_sums(const Lattice *lattice, uint32_t handle) {
+  KeywordKind kind = VALUE_HANDLE_KIND(handle);
+  if (!is_element_kind(kind)) {
+    fprintf(stderr, "ERR: 0x%08x is not the handle of an element.\n", handle);
+    exit(1);
+  }
+
+  const ElementKind *info = &element_kinds[kind];
+  uint32_t row = VALUE_HANDLE_INDEX(handle);
+  LineSums sums = { .element_count = 1 };
+  for (uint32_t p=0; p<ELEMENT_PARAM_COUNT; p++) {
+    if (!info->slots[p].present) continue;
+    double value = element_column(lattice, kind, p)[row];
+    switch (info->slots[p].sum) {
+      case ELEMENT_SUM_NONE:                        break;
+      case ELEMENT_SUM_LENGTH: sums.length = value; break;
+      case ELEMENT_SUM_ANGLE:  sums.angle = value;  break;
+      case ELEMENT_SUM_K1L:    sums.k1l = value;    break;
+      case ELEMENT_SUM_K2L:    sums.k2l = value;    break;
+      case ELEMENT_SUM_K3L:    sums.k3l = value;    break;
+    }
+  }
+  sums.k1l *= sums.length;
+  sums.k2l *= sums.length;
+  sums.k3l *= sums.length;
+  return sums;
+}
+
+static LineSums sum_item(Lattice *lattice, uint32_t handle) {
+  if (VALUE_HANDLE_KIND(handle) != KEYWORD_LINE) return element_sums(lattice, handle);
+
+  Line *line = &lattice->lines[VALUE_HANDLE_INDEX(handle)];
+  if (line->summed) return line->sums;
+
+  // Recursion only goes as deep as the lines are nested
+  LineSums sums = {0};
+  for (uint32_t i=0; i<line->item_count; i++) {
+    const LineItem *item = &line->items[i];
+    LineSums part = sum_item(lattice, item->target);
+    sums.element_count += part.element_count * item->repeat;
+    sums.length += part.length * item->repeat;
+    sums.angle += part.angle * item->repeat;
+    sums.k1l += part.k1l * item->repeat;
+    sums.k2l += part.k2l * item->repeat;
+    sums.k3l += part.k3l * item->repeat;
+  }
+  line->sums = sums;
+  line->summed = true;
+  return sums;
+}
+
+LineSums lattice_sums(Lattice *lattice, uint32_t handle) {
+  // The memoised sums are written as they are worked out, so this holds the lock
+  mtx_lock(&lattice->lock);
+  LineSums sums = sum_item(lattice, handle);
+  mtx_unlock(&lattice->lock);
+  return sums;
+}
+
+static void push_frame(LineIterator *iterator, uint32_t line_handle, bool reversed) {
+  const Line *line = lattice_line(iterator->lattice, line_handle);
+  iterator->frames[iterator->depth++] = (LineFrame){
+    .items = line->items,
+    .item_count = line->item_count,
+    .reversed = reversed,
+  };
+}
+
+void line_iterator_init(LineIterator *iterator, const Lattice *lattice, uint32_t handle, bool reversed) {
+  iterator->lattice = lattice;
+  iterator->depth = 0;
+  iterator->element = LINE_NO_ELEMENT;
+  iterator->element_reversed = reversed;
+  if (VALUE_HANDLE_KIND(handle) == KEYWORD_LINE) push_frame(iterator, handle, reversed);
+  else iterator->element = handle;
+}
+
+bool line_iterator_next(LineIterator *iterator, uint32_t *element, bool *reversed) {
+  if (iterator->element != LINE_NO_ELEMENT) {
+    *element = iterator->element;
+    if (reversed != NULL) *reversed = iterator->element_reversed;
+    iterator->element = LINE_NO_ELEMENT;
+    return true;
+  }
+
+  while (iterator->depth > 0) {
+    LineFrame *frame = &iterator->frames[iterator->depth - 1];
+    if (frame->next == frame->item_count) {
+      iterator->depth--;
+      continue;
+    }
+
+    // A reversed line is read from its last item to its first
+    const LineItem *item = &frame->items[frame->reversed ? frame->item_count - 1 - frame->next : frame->next];
+    if (frame->repeats_left == 0) frame->repeats_left = item->repeat;
+    if (--frame->repeats_left == 0) frame->next++;
+
+    bool backwards = frame->reversed != ((item->flags & LINE_ITEM_REVERSED) != 0);
+    if (VALUE_HANDLE_KIND(item->target) == KEYWORD_LINE) {
+      push_frame(iterator, item->target, backwards);
+      continue;
+    }
+    *element = item->target;
+    if (reversed != NULL) *reversed = backwards;
+    return true;
+  }
+  return false;
+}
+
+uint32_t line_iterator_next_block(LineIterator *iterator, uint32_t *elements, bool *reversed, uint32_t capacity) {
+  uint32_t count = 0;
+  while (count < capacity && line_iterator_next(iterator, &elements[count], reversed != NULL ? &reversed[count] : NULL)) {
+    count++;
+  }
+  return count;
+}
+
+static bool construct(void *context, uint32_t index, Value *result) {
+  Lattice *lattice = context;
+  const Ast *ast = lattice->evaluator->ast;
+  const AstNode *call = ast_node(ast, index);
+  if (call->op == KEYWORD_LINE) return construct_line(lattice, call, result);
+  if (is_element_kind(call->op)) return construct_element(lattice, call, result);
+  ast_error(ast, call->offset, "Can't evaluate a call to %s", keyword_name(call->op));
+  return false;
+}
+
+bool lattice_init(Lattice *lattice, Evaluator *evaluator) {
+  memset(lattice, 0, sizeof(*lattice));
+  lattice->evaluator = evaluator;
+  lattice->arena.capacity = LATTICE_ARENA_CAP;
+
+  for (uint32_t p=0; p<ELEMENT_PARAM_COUNT; p++) {
+    sdm_string_view name = sdm_cstr_as_sv((char*)element_param_names[p]);
+    lattice->param_symbols[p] = intern_symbol(name, sdm_sv_hash(name));
+  }
+
+  Ast *ast = evaluator->ast;
+  bool ok = true;
+  for (size_t i=0; i<ast->nodes.length; i++) {
+    AstNode *node = &ast->nodes.data[i];
+    if (node->kind != AST_NODE_CALL) continue;
+    uint32_t *count;
+    if (node->op == KEYWORD_LINE) {
+      count = &lattice->line_count;
+    } else if (is_element_kind(node->op)) {
+      count = &lattice->element_counts[node->op];
+      ok = bind_element_args(lattice, node) && ok;
+    } else {
+      continue;
+    }
+    if (*count > VALUE_HANDLE_MAX_INDEX) {
+      // The tables are still set up below, so that the lattice can be freed as usual
+      ast_error(ast, node->offset, "Too many constructor calls (the limit is %u of each kind)", VALUE_HANDLE_MAX_INDEX + 1);
+      ok = false;
+      break;
+    }
+    node->lhs = (*count)++;
+  }
+
+  for (KeywordKind kind=0; kind<KEYWORD_COUNT; kind++) {
+    if (!is_element_kind(kind)) continue;
+    const ElementKind *info = &element_kinds[kind];
+    for (uint32_t p=0; p<ELEMENT_PARAM_COUNT; p++) {
+      if (!info->slots[p].present) continue;
+      double **column = (double**)((char*)lattice + info->table + info->slots[p].column);
+      *column = SDM_MALLOC((lattice->element_counts[kind] + 1) * sizeof(double));
+      if (*column == NULL) {
+        fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+        exit(1);
+      }
+      for (uint32_t row=0; row<=lattice->element_counts[kind]; row++) (*column)[row] = info->slots[p].default_value;
+    }
+  }
+  lattice->lines = SDM_MALLOC((lattice->line_count + 1) * sizeof(Line));
+  if (lattice->lines == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+  memset(lattice->lines, 0, (lattice->line_count + 1) * sizeof(Line));
+  if (mtx_init(&lattice->lock, mtx_plain) != thrd_success) {
+    fprintf(stderr, "ERR: Couldn't create a mutex.\n");
+    exit(1);
+  }
+
+  evaluator->construct = construct;
+  evaluator->construct_context = lattice;
+  return ok;
+}
+
+void lattice_free(Lattice *lattice) {
+  lattice->evaluator->construct = NULL;
+  lattice->evaluator->construct_context = NULL;
+  mtx_destroy(&lattice->lock);
+  sdm_arena_free(&lattice->arena);
+}
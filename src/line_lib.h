@@ -0,0 +1,146 @@
+#ifndef _LINE_LIB_H
+#define _LINE_LIB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <threads.h>
+
+#include "ast_lib.h"
+#include "element_schema.h"
+#include "eval_lib.h"
+#include "sdm_lib.h"
+
+// Elements and lines live in tables indexed by the call site of their constructor:
+// lattice_init numbers the constructor calls of each kind in the AST and stores each
+// one's number in the CALL node's lhs.  The numbering only depends on the source, so
+// a binding gets the same handle however (and however often) it is evaluated.
+
+// One per entry of ELEMENT_PARAM_LIST in element_schema.h
+typedef enum {
+#define X(name, first, last) ELEMENT_PARAM_##name,
+  ELEMENT_PARAM_LIST(X)
+#undef X
+  ELEMENT_PARAM_COUNT,
+} ElementParam;
+
+#define ELEMENT_NO_PARAM UINT8_MAX
+#define ELEMENT_PARAM_TABLE_SIZE 16
+#define ELEMENT_PARAM_HASH(length, first, last) \
+  (((length) + (unsigned char)(first) + (unsigned char)(last)) & (ELEMENT_PARAM_TABLE_SIZE - 1))
+
+// What a parameter adds to the totals of a line (see LineSums).  The strengths are
+// integrated, i.e. multiplied by the element's length.
+typedef enum {
+  ELEMENT_SUM_NONE = 0,
+  ELEMENT_SUM_LENGTH,
+  ELEMENT_SUM_ANGLE,
+  ELEMENT_SUM_K1L,
+  ELEMENT_SUM_K2L,
+  ELEMENT_SUM_K3L,
+} ElementSum;
+
+// Each kind of element has a table of its own, with a column for each parameter, so
+// that a pass over every quadrupole (say) is a loop along contiguous arrays.  An
+// element's handle holds its kind and its row.
+#define ELEMENT_COLUMN(type, name, default, sum) double *name;
+#define X(keyword, type, table, params) typedef struct { params(ELEMENT_COLUMN, type) } type##Table;
+ELEMENT_KINDS(X)
+#undef X
+#undef ELEMENT_COLUMN
+
+// A line is never expanded into the elements it stands for.  It keeps a list of
+// items, each an element or another line, which may be reversed and repeated, so
+// a lattice is a DAG about the size of its source however long the ring is.
+#define LINE_ITEM_REVERSED 0x1
+// How deeply lines can be nested, which bounds what it takes to walk one
+#define LINE_MAX_DEPTH 64
+
+typedef struct {
+  uint32_t target;  // Handle of an element, or of a line if its kind is KEYWORD_LINE
+  uint32_t repeat;
+  uint32_t flags;
+} LineItem;
+
+// Totals over everything a line expands to
+typedef struct {
+  uint64_t element_count;
+  double length;
+  double angle;  // Bending angle
+  double k1l;    // Integrated quadrupole, sextupole and octupole strengths
+  double k2l;
+  double k3l;
+} LineSums;
+
+typedef struct {
+  const LineItem *items;  // Hash-consed: lines with the same items share them
+  uint32_t item_count;
+  uint32_t depth;         // 1 for a line holding only elements
+  bool summed;            // sums is up to date
+  LineSums sums;
+} Line;
+
+typedef struct {
+  Evaluator *evaluator;
+  mtx_t lock;               // Lines may be constructed on several threads at once
+  sdm_arena_t arena;        // What the line constructors allocate
+  uint32_t element_counts[KEYWORD_COUNT];  // Rows in each kind's table
+#define X(keyword, type, table, params) type##Table table;
+  ELEMENT_KINDS(X)
+#undef X
+  uint32_t param_symbols[ELEMENT_PARAM_COUNT];  // The symbol of each parameter's name
+  Line *lines;
+  uint32_t line_count;
+  sdm_interner item_lists;  // Keyed by the bytes of the items
+} Lattice;
+
+// Numbers the constructor calls and has the evaluator hand them to the lattice.  The
+// arguments of element constructors are bound to their parameters here, with each
+// NAMED_ARG's op set to an ElementParam.  Returns false (after reporting) if an
+// argument isn't one the element takes, or there are more calls than a handle can
+// refer to.  Either way the lattice is set up and must be freed with lattice_free.
+bool lattice_init(Lattice *lattice, Evaluator *evaluator);
+void lattice_free(Lattice *lattice);
+
+// The totals for an element or line.  Each line's are worked out from its items'
+// the first time they are needed and kept until the line is constructed again:
+// reversing an item leaves them as they are, and repeating it multiplies them.
+// This takes the lock, so it may be called from the evaluator's worker threads.
+LineSums lattice_sums(Lattice *lattice, uint32_t handle);
+
+// Walks the elements a line expands to, in beam order, without expanding it.  It
+// keeps one frame per level of nesting, so it takes the same small, fixed amount of
+// memory however long the ring is.
+typedef struct {
+  const LineItem *items;
+  uint32_t item_count;
+  uint32_t next;         // How many items have been finished
+  uint32_t repeats_left; // Passes still to make over the current item, or 0 if it hasn't been started
+  bool reversed;
+} LineFrame;
+
+// Not a handle: its top byte isn't a KeywordKind
+#define LINE_NO_ELEMENT UINT32_MAX
+
+typedef struct {
+  const Lattice *lattice;
+  uint32_t element;      // The one element to yield when iterating over an element, or LINE_NO_ELEMENT
+  bool element_reversed;
+  uint32_t depth;
+  LineFrame frames[LINE_MAX_DEPTH];
+} LineIterator;
+
+// handle may be an element or a line, which is walked backwards if reversed is set
+void line_iterator_init(LineIterator *iterator, const Lattice *lattice, uint32_t handle, bool reversed);
+// Gives the next element's handle, and whether it is traversed backwards (which may
+// be NULL if that doesn't matter).  Returns false at the end.
+bool line_iterator_next(LineIterator *iterator, uint32_t *element, bool *reversed);
+// Fills elements (and reversed, unless it is NULL) with up to capacity of the next
+// elements, for consumers that work on a block at a time.  Returns how many it
+// filled, which is only less than capacity at the end.
+uint32_t line_iterator_next_block(LineIterator *iterator, uint32_t *elements, bool *reversed, uint32_t capacity);
+
+static inline const Line *lattice_line(const Lattice *lattice, uint32_t handle) {
+  return &lattice->lines[VALUE_HANDLE_INDEX(handle)];
+}
+
+#endif // !_LINE_LIB_H
@@ -12,17 +12,59 @@
 
 #define EXTERN
 #include "token_lib.h"
+#include "ast_lib.h"
+#include "eval_lib.h"
+#include "vm_lib.h"
+#include "line_lib.h"
 
 #define SDM_ARRAY_LENGTH(array) sizeof((array)) / sizeof((array[0]))
 
 static sdm_arena_t main_arena = {0};
-static sdm_arena_t *active_arena = &main_arena;
+static _Thread_local sdm_arena_t *active_arena = &main_arena;
 
 void *active_alloc(size_t size)              { return sdm_arena_alloc(active_arena, size); }
 void *active_realloc(void *ptr, size_t size) { return sdm_arena_realloc(active_arena, ptr, size); }
 
-int main(void) {
+sdm_arena_t *active_swap_arena(sdm_arena_t *arena) {
+  sdm_arena_t *previous = active_arena;
+  active_arena = arena;
+  return previous;
+}
+
+void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [--dump-tokens | --dump-ast | --run] [--jobs N] [input_file]\n", program);
+}
+
+int main(int argc, char **argv) {
+  char *program = sdm_shift_args(&argc, &argv);
   char *input_filename = "examples/example.txt";
+  bool dump_token_stream = false;
+  bool dump_syntax_tree = false;
+  bool run_program = false;
+  size_t jobs = 0;
+
+  char *arg;
+  while ((arg = sdm_shift_args(&argc, &argv)) != NULL) {
+    if (strcmp(arg, "--dump-tokens") == 0) {
+      dump_token_stream = true;
+    } else if (strcmp(arg, "--dump-ast") == 0) {
+      dump_syntax_tree = true;
+    } else if (strcmp(arg, "--run") == 0) {
+      run_program = true;
+    } else if (strcmp(arg, "--jobs") == 0) {
+      char *count = sdm_shift_args(&argc, &argv);
+      if (count == NULL || (jobs = strtoul(count, NULL, 10)) == 0) {
+        usage(program);
+        return 1;
+      }
+    } else if (arg[0] == '-') {
+      usage(program);
+      return 1;
+    } else {
+      input_filename = arg;
+    }
+  }
+
   char *buffer = sdm_read_entire_file(input_filename);
 
   Parser parser = {
@@ -33,8 +75,53 @@ int main(void) {
     .index = 0,
   };
 
+  if (run_program) {
+    Ast ast = {0};
+    static Evaluator evaluator;
+    static Lattice lattice;
+    static Vm vm;
+    bool ok = parse_program(&parser, &ast) && evaluator_init(&evaluator, &ast) && lattice_init(&lattice, &evaluator);
+    if (ok) {
+      vm_init(&vm, &evaluator);
+      vm.lattice = &lattice;
+      // Each binding is evaluated when the program first uses it; with --jobs, those it
+      // will use are worked out up front, in parallel
+      if (jobs > 0) evaluate_reachable(&evaluator, jobs);
+      ok = ok && vm_compile(&vm) && vm_run(&vm);
+      lattice_free(&lattice);
+    }
+    evaluator_free(&evaluator);
+    sdm_arena_free(&main_arena);
+    return ok ? 0 : 1;
+  }
+
+  if (dump_syntax_tree) {
+    Ast ast = {0};
+    if (!parse_program(&parser, &ast)) {
+      sdm_arena_free(&main_arena);
+      return 1;
+    }
+    static sdm_writer writer;
+    sdm_writer_init(&writer, stdout);
+    dump_ast(&writer, &ast);
+    sdm_writer_flush(&writer);
+    sdm_arena_free(&main_arena);
+    return 0;
+  }
+
+  // With --jobs a large file is lexed in pieces, one per thread
   TokenArray token_array = {0};
-  tokenise_input_file(&parser, &token_array);
+  tokenise_input_file_parallel(&parser, &token_array, jobs);
+
+  if (dump_token_stream) {
+    static sdm_writer writer;
+    sdm_writer_init(&writer, stdout);
+    dump_tokens(&writer, &token_array);
+    sdm_writer_flush(&writer);
+    sdm_arena_free(&main_arena);
+    return 0;
+  }
+
   printf("Found %zu tokens, %zu lines, and %zu characters in %s\n", token_array.length, parser.line, parser.index, parser.filename);
 
   sdm_arena_free(&main_arena);
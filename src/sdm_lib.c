@@ -1,10 +1,43 @@
-#include <ctype.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <threads.h>
 
 #include "sdm_lib.h"
+#include "sdm_ryu_tables.h"
+
+
+#define A (SDM_CHAR_ID_START | SDM_CHAR_ID_CONT)
+#define D (SDM_CHAR_ID_CONT | SDM_CHAR_DIGIT)
+#define U SDM_CHAR_ID_CONT
+#define S SDM_CHAR_SPACE
+#define P SDM_CHAR_PUNCT
+const uint8_t sdm_char_class[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, S, S, S, S, S, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  S, P, P, P, P, P, P, P, P, P, P, P, P, P, P, P,
+  D, D, D, D, D, D, D, D, D, D, P, P, P, P, P, P,
+  P, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+  A, A, A, A, A, A, A, A, A, A, A, P, P, P, P, U,
+  P, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+  A, A, A, A, A, A, A, A, A, A, A, P, P, P, P, 0,
+};
+#undef A
+#undef D
+#undef U
+#undef S
+#undef P
+
+size_t sdm_skip_id_chars(const char *data, size_t index) {
+  // data must be padded (see SDM_INPUT_PADDING): the NUL sentinel ends every run, and the
+  // padding makes the block loads that straddle it safe.
+  for (;;) {
+    unsigned mask = sdm_classify_block(data + index).id;
+    if (mask != (1u << SDM_CLASSIFY_BLOCK) - 1) return index + __builtin_ctz(~mask);
+    index += SDM_CLASSIFY_BLOCK;
+  }
+}
 
 char *sdm_read_entire_file(const char *file_path) {
   // Reads an entire file into a char array, and returns a ptr to this. The ptr should be freed by the caller
@@ -15,21 +48,33 @@ char *sdm_read_entire_file(const char *file_path) {
   }
 
   fseek(f, 0L, SEEK_END);
-  int sz = ftell(f);
+  long sz = ftell(f);
   fseek(f, 0L, SEEK_SET);
 
-  char *contents = SDM_MALLOC((sz + 1) * sizeof(char));
+  char *contents = SDM_MALLOC((sz + SDM_INPUT_PADDING) * sizeof(char));
   if (contents==NULL) {
     fprintf(stderr, "Could not allocate memory. Buy more RAM I guess?\n");
     exit(1);
   }
-  fread(contents, 1, sz, f);
+  size_t read = fread(contents, 1, sz, f);
+  memset(contents + read, 0, sz + SDM_INPUT_PADDING - read);
 
   fclose(f);
   
   return contents;
 }
 
+char *sdm_pad_string(const char *data, size_t length) {
+  char *padded = SDM_MALLOC(length + SDM_INPUT_PADDING);
+  if (padded==NULL) {
+    fprintf(stderr, "Could not allocate memory. Buy more RAM I guess?\n");
+    exit(1);
+  }
+  memcpy(padded, data, length);
+  memset(padded + length, 0, SDM_INPUT_PADDING);
+  return padded;
+}
+
 sdm_string_view sdm_cstr_as_sv(char *cstr) {
   return (sdm_string_view){
     .data = cstr,
@@ -65,7 +110,7 @@ sdm_string_view sdm_sv_pop_by_whitespace(sdm_string_view *SV) {
   sdm_string_view ret = {0};
   ret.data = SV->data;
 
-  while (!isspace(*SV->data) && (SV->length>0)) {
+  while (!sdm_is_space(*SV->data) && (SV->length>0)) {
     SV->data++;
     SV->length--;
     ret.length++;
@@ -108,7 +153,7 @@ char sdm_sv_pop_one_char(sdm_string_view *SV) {
 }
 
 void sdm_sv_trim(sdm_string_view *SV) {
-  while (isspace(*SV->data) && SV->length>0) {
+  while (sdm_is_space(*SV->data) && SV->length>0) {
     SV->data++;
     SV->length--;
   }
@@ -127,41 +172,609 @@ char *sdm_shift_args(int *argc, char ***argv) {
   return *ret;
 }
 
-uint32_t get_hashmap_location(const char* key, size_t capacity) {
-  uint32_t key_hash = hash((uint8_t*)key, strlen(key));
-  return key_hash % capacity;
+uint64_t sdm_sv_hash(sdm_string_view sv) {
+  return sdm_hash_bytes(sv.data, sv.length);
+}
+
+void sdm_hm_index_init(sdm_hm_index *index, size_t capacity) {
+  size_t pow2 = 8;
+  while (pow2 < capacity) pow2 *= 2;
+
+  index->ctrl   = SDM_MALLOC(pow2 * sizeof(index->ctrl[0]));
+  index->hashes = SDM_MALLOC(pow2 * sizeof(index->hashes[0]));
+  index->keys   = SDM_MALLOC(pow2 * sizeof(index->keys[0]));
+  if (index->ctrl == NULL || index->hashes == NULL || index->keys == NULL) {
+    fprintf(stderr, "ERR: Can't alloc.\n");
+    exit(1);
+  }
+  memset(index->ctrl, SDM_HM_EMPTY, pow2 * sizeof(index->ctrl[0]));
+  index->length = 0;
+  index->capacity = pow2;
+}
+
+int64_t sdm_hm_find(const sdm_hm_index *index, sdm_string_view key, uint64_t hash) {
+  if (index->capacity == 0) return -1;
+
+  size_t mask = index->capacity - 1;
+  uint8_t tag = SDM_HM_TAG(hash);
+  for (size_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+    uint8_t ctrl = index->ctrl[slot];
+    if (ctrl == SDM_HM_EMPTY) return -1;
+    if (ctrl == tag && index->hashes[slot] == hash && sdm_sv_compare(index->keys[slot], key)) {
+      return slot;
+    }
+  }
+}
+
+size_t sdm_hm_insert_slot(sdm_hm_index *index, sdm_string_view key, uint64_t hash, bool *existed) {
+  // The caller is responsible for making sure there is room (see SDM_HM_NEEDS_GROW)
+  size_t mask = index->capacity - 1;
+  uint8_t tag = SDM_HM_TAG(hash);
+  size_t slot = hash & mask;
+  while (index->ctrl[slot] != SDM_HM_EMPTY) {
+    if (index->ctrl[slot] == tag && index->hashes[slot] == hash && sdm_sv_compare(index->keys[slot], key)) {
+      if (existed) *existed = true;
+      return slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  index->ctrl[slot] = tag;
+  index->hashes[slot] = hash;
+  index->keys[slot] = key;
+  index->length++;
+  if (existed) *existed = false;
+  return slot;
 }
 
-void resize_dblarray(DblArray *hm) {
-  DblArray resized_array = {0};
-  SET_HM_CAPACITY((&resized_array), hm->capacity * 2);
-  for (size_t i=0; i<hm->capacity; i++) {
-    if (!hm->data[i].occupied) continue;
-    push_to_dblarray(&resized_array, hm->data[i].key, hm->data[i].value);
+void *sdm_hm_grow(sdm_hm_index *index, void *values, size_t value_size) {
+  // Double the capacity, moving each occupied slot (and its value) to its new home.
+  // The stored hashes mean that no key is rehashed or even read.
+  sdm_hm_index old = *index;
+  sdm_hm_index_init(index, old.capacity * 2);
+
+  char *new_values = SDM_MALLOC(index->capacity * value_size);
+  if (new_values == NULL) {
+    fprintf(stderr, "ERR: Can't alloc.\n");
+    exit(1);
+  }
+
+  size_t mask = index->capacity - 1;
+  for (size_t i=0; i<old.capacity; i++) {
+    if (old.ctrl[i] == SDM_HM_EMPTY) continue;
+    size_t slot = old.hashes[i] & mask;
+    while (index->ctrl[slot] != SDM_HM_EMPTY) slot = (slot + 1) & mask;
+    index->ctrl[slot] = old.ctrl[i];
+    index->hashes[slot] = old.hashes[i];
+    index->keys[slot] = old.keys[i];
+    memcpy(new_values + slot * value_size, (char*)values + i * value_size, value_size);
   }
-  hm->capacity = resized_array.capacity;
-  SDM_FREE(hm->data);
-  hm->data = resized_array.data;
+  index->length = old.length;
+
+  return new_values;
+}
+
+void push_to_dblarray(DblArray *hm, sdm_string_view key, double value) {
+  PUSH_TO_HASHMAP(hm, key, sdm_sv_hash(key), value);
+}
+
+bool get_from_dblarray(const DblArray *hm, sdm_string_view key, double *value) {
+  int64_t index;
+  GET_HASHMAP_INDEX(*hm, key, sdm_sv_hash(key), &index);
+  if (index < 0) return false;
+  *value = HM_VAL_AT(*hm, index);
+  return true;
+}
+
+uint32_t sdm_intern(sdm_interner *interner, sdm_string_view name, uint64_t hash) {
+  int64_t index;
+  GET_HASHMAP_INDEX(*interner, name, hash, &index);
+  if (index >= 0) return HM_VAL_AT(*interner, index);
+
+  uint32_t id = interner->names.length;
+  sdm_string_view copy = sdm_sized_str_as_sv(sdm_sv_to_cstr(name), name.length);
+  SDM_ARRAY_PUSH(interner->names, copy);
+  PUSH_TO_HASHMAP(interner, copy, hash, id);
+  return id;
 }
 
-void push_to_dblarray(DblArray *hm, char *key, double value) {
-  if (hm->length >= hm->capacity) resize_dblarray(hm);
-  PUSH_TO_HASHMAP(hm, key, value);
+bool sdm_interner_find(const sdm_interner *interner, sdm_string_view name, uint64_t hash, uint32_t *id) {
+  int64_t index;
+  GET_HASHMAP_INDEX(*interner, name, hash, &index);
+  if (index < 0) return false;
+  *id = HM_VAL_AT(*interner, index);
+  return true;
+}
+
+sdm_string_view sdm_interned_name(const sdm_interner *interner, uint32_t id) {
+  return interner->names.data[id];
 }
 
-// https://en.wikipedia.org/wiki/Jenkins_hash_function
-uint32_t jenkins_one_at_a_time_hash(const uint8_t* key, size_t length) {
+// A slot is 0 while empty, SDM_CI_PENDING(tag) while the thread that claimed it fills
+// in its entry, and SDM_CI_SLOT(tag, id) once the entry is published
+#define SDM_CI_SLOT(tag, id) (((uint64_t)(tag) << 32) | ((uint64_t)(id) + 1))
+#define SDM_CI_PENDING(tag) ((uint64_t)(tag) << 32)
+#define SDM_CI_IS_PENDING(slot_value) ((uint32_t)(slot_value) == 0)
+
+void sdm_concurrent_interner_init(sdm_concurrent_interner *interner, size_t max_names) {
+  size_t slot_capacity = 8;
+  while (slot_capacity * 7 < (max_names + 1) * 8) slot_capacity *= 2;
+
+  interner->slots = SDM_MALLOC(slot_capacity * sizeof(interner->slots[0]));
+  interner->entries = SDM_MALLOC(max_names * sizeof(interner->entries[0]));
+  if (interner->slots == NULL || interner->entries == NULL) {
+    fprintf(stderr, "ERR: Can't alloc.\n");
+    exit(1);
+  }
+  for (size_t i=0; i<slot_capacity; i++) atomic_init(&interner->slots[i], 0);
+  interner->slot_capacity = slot_capacity;
+  interner->entry_capacity = max_names;
+  atomic_init(&interner->next_id, 0);
+}
+
+static bool sdm_concurrent_entry_matches(const sdm_concurrent_interner *interner, uint64_t slot_value,
+                                         sdm_string_view name, uint64_t hash, uint32_t *id) {
+  if ((uint8_t)(slot_value >> 32) != SDM_HM_TAG(hash)) return false;
+  uint32_t candidate = (uint32_t)slot_value - 1;
+  const sdm_concurrent_entry *entry = &interner->entries[candidate];
+  if (entry->hash != hash || !sdm_sv_compare(entry->name, name)) return false;
+  *id = candidate;
+  return true;
+}
+
+static uint64_t sdm_concurrent_wait(const sdm_concurrent_interner *interner, size_t slot, uint64_t current) {
+  // The claiming thread only has a few stores left to make, so this is a short wait
+  while (SDM_CI_IS_PENDING(current)) {
+    thrd_yield();
+    current = atomic_load_explicit(&interner->slots[slot], memory_order_acquire);
+  }
+  return current;
+}
+
+uint32_t sdm_concurrent_intern(sdm_concurrent_interner *interner, sdm_string_view name, uint64_t hash, size_t offset) {
+  size_t mask = interner->slot_capacity - 1;
+  uint8_t tag = SDM_HM_TAG(hash);
+  uint32_t id;
+
+  for (size_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+    uint64_t current = atomic_load_explicit(&interner->slots[slot], memory_order_acquire);
+
+    // The id is only taken once the slot is ours, so a thread that loses the race to
+    // insert a name never uses one up, and the ids stay dense
+    if (current == 0 &&
+        atomic_compare_exchange_strong_explicit(&interner->slots[slot], &current, SDM_CI_PENDING(tag),
+                                                memory_order_acq_rel, memory_order_acquire)) {
+      id = atomic_fetch_add_explicit(&interner->next_id, 1, memory_order_relaxed);
+      if (id >= interner->entry_capacity) {
+        fprintf(stderr, "Concurrent interner has insufficient capacity.\n");
+        exit(1);
+      }
+      sdm_concurrent_entry *entry = &interner->entries[id];
+      entry->name = name;
+      entry->hash = hash;
+      atomic_init(&entry->first_offset, offset);
+      atomic_store_explicit(&interner->slots[slot], SDM_CI_SLOT(tag, id), memory_order_release);
+      return id;
+    }
+    // Otherwise the slot is taken; only an entry with our tag can be our name
+    if ((uint8_t)(current >> 32) != tag) continue;
+    current = sdm_concurrent_wait(interner, slot, current);
+
+    if (sdm_concurrent_entry_matches(interner, current, name, hash, &id)) {
+      size_t seen = atomic_load_explicit(&interner->entries[id].first_offset, memory_order_relaxed);
+      while (offset < seen &&
+             !atomic_compare_exchange_weak_explicit(&interner->entries[id].first_offset, &seen, offset,
+                                                    memory_order_relaxed, memory_order_relaxed));
+      return id;
+    }
+  }
+}
+
+bool sdm_concurrent_find(const sdm_concurrent_interner *interner, sdm_string_view name, uint64_t hash, uint32_t *id) {
+  size_t mask = interner->slot_capacity - 1;
+  for (size_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+    uint64_t current = atomic_load_explicit(&interner->slots[slot], memory_order_acquire);
+    if (current == 0) return false;
+    if ((uint8_t)(current >> 32) != SDM_HM_TAG(hash)) continue;
+    current = sdm_concurrent_wait(interner, slot, current);
+    if (sdm_concurrent_entry_matches(interner, current, name, hash, id)) return true;
+  }
+}
+
+static const sdm_concurrent_entry *sdm_ci_sort_entries;
+
+static int sdm_ci_compare_offsets(const void *a, const void *b) {
+  size_t offset_a = atomic_load_explicit(&sdm_ci_sort_entries[*(const uint32_t*)a].first_offset, memory_order_relaxed);
+  size_t offset_b = atomic_load_explicit(&sdm_ci_sort_entries[*(const uint32_t*)b].first_offset, memory_order_relaxed);
+  return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+void sdm_concurrent_interner_canonicalise(const sdm_concurrent_interner *interner, sdm_interner *target, uint32_t *remap) {
+  // Must only be called once every thread has finished interning.  remap needs room for one
+  // entry per id handed out, and maps each of those ids to its id in target.
+  uint32_t id_count = atomic_load(&interner->next_id);
+  uint32_t *order = SDM_MALLOC(id_count * sizeof(order[0]));
+  if (id_count > 0 && order == NULL) {
+    fprintf(stderr, "ERR: Can't alloc.\n");
+    exit(1);
+  }
+  for (uint32_t id=0; id<id_count; id++) order[id] = id;
+
+  sdm_ci_sort_entries = interner->entries;
+  qsort(order, id_count, sizeof(order[0]), sdm_ci_compare_offsets);
+
+  for (size_t i=0; i<id_count; i++) {
+    const sdm_concurrent_entry *entry = &interner->entries[order[i]];
+    remap[order[i]] = sdm_intern(target, entry->name, entry->hash);
+  }
+}
+
+void sdm_ws_deque_init(sdm_ws_deque *deque, size_t capacity) {
+  size_t size = 16;
+  while (size < capacity) size *= 2;
+  deque->items = SDM_MALLOC(size * sizeof(deque->items[0]));
+  if (deque->items == NULL) {
+    fprintf(stderr, "ERR: Can't alloc.\n");
+    exit(1);
+  }
+  for (size_t i=0; i<size; i++) atomic_init(&deque->items[i], 0);
+  deque->mask = (int64_t)size - 1;
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+}
+
+// The orderings follow Le, Pop, Cohen and Zappa Nardelli, "Correct and Efficient
+// Work-Stealing for Weak Memory Models" (PPoPP 2013)
+void sdm_ws_deque_push(sdm_ws_deque *deque, uint32_t item) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  atomic_store_explicit(&deque->items[bottom & deque->mask], item, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+bool sdm_ws_deque_take(sdm_ws_deque *deque, uint32_t *item) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (top > bottom) {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return false;
+  }
+
+  *item = atomic_load_explicit(&deque->items[bottom & deque->mask], memory_order_relaxed);
+  if (top == bottom) {
+    // The last item: race any thieves for it
+    bool won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                       memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return won;
+  }
+  return true;
+}
+
+bool sdm_ws_deque_steal(sdm_ws_deque *deque, uint32_t *item) {
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (top >= bottom) return false;
+
+  *item = atomic_load_explicit(&deque->items[top & deque->mask], memory_order_relaxed);
+  return atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed);
+}
+
+static uint64_t sdm_read_u64_le(const uint8_t *bytes) {
+  uint64_t word;
+  memcpy(&word, bytes, sizeof(word));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+uint64_t sdm_hash_bytes(const void *data, size_t length) {
+  const uint8_t *bytes = data;
+  uint64_t state = 0;
+
   size_t i = 0;
-  uint32_t hash = 0;
-  while (i != length) {
-    hash += key[i++];
-    hash += hash << 10;
-    hash ^= hash >> 6;
+  for (; i + 8 <= length; i += 8) {
+    state = sdm_hash_mix(sdm_read_u64_le(bytes + i) ^ SDM_HASH_P1, state ^ SDM_HASH_P0);
+  }
+  if (i < length) {
+    uint64_t word = 0;
+    for (size_t shift=0; i<length; i++, shift+=8) word |= (uint64_t)bytes[i] << shift;
+    state = sdm_hash_mix(word ^ SDM_HASH_P1, state ^ SDM_HASH_P0);
+  }
+
+  return sdm_hash_mix(state ^ SDM_HASH_P2, (uint64_t)length ^ SDM_HASH_P1);
+}
+
+void sdm_writer_init(sdm_writer *writer, FILE *stream) {
+  writer->stream = stream;
+  writer->length = 0;
+}
+
+void sdm_writer_flush(sdm_writer *writer) {
+  if (writer->length > 0) fwrite(writer->buffer, 1, writer->length, writer->stream);
+  writer->length = 0;
+}
+
+void sdm_write_bytes(sdm_writer *writer, const char *data, size_t length) {
+  if (writer->length + length > SDM_WRITER_CAP) {
+    sdm_writer_flush(writer);
+    if (length > SDM_WRITER_CAP) {
+      fwrite(data, 1, length, writer->stream);
+      return;
+    }
+  }
+  memcpy(writer->buffer + writer->length, data, length);
+  writer->length += length;
+}
+
+void sdm_write_cstr(sdm_writer *writer, const char *cstr) {
+  sdm_write_bytes(writer, cstr, strlen(cstr));
+}
+
+void sdm_write_sv(sdm_writer *writer, sdm_string_view sv) {
+  sdm_write_bytes(writer, sv.data, sv.length);
+}
+
+void sdm_write_int(sdm_writer *writer, int64_t value) {
+  char digits[24];
+  sdm_write_bytes(writer, digits, sdm_format_int(value, digits));
+}
+
+void sdm_write_double(sdm_writer *writer, double value) {
+  char digits[32];
+  sdm_write_bytes(writer, digits, sdm_format_double(value, digits));
+}
+
+size_t sdm_format_int(int64_t value, char *out) {
+  char reversed[20];
+  size_t n = 0;
+  size_t length = 0;
+  uint64_t magnitude = (value < 0) ? -(uint64_t)value : (uint64_t)value;
+  do {
+    reversed[n++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude > 0);
+  if (value < 0) out[length++] = '-';
+  while (n > 0) out[length++] = reversed[--n];
+  return length;
+}
+
+// sdm_format_double finds the shortest digits with Ryu (Ulf Adams, "Ryu: fast float-to-string
+// conversion", PLDI 2018): the halfway points to the neighbouring doubles are scaled by a power of
+// ten using a 128-bit table entry, and digits are dropped for as long as both still agree.
+static inline uint64_t sdm_umul128(uint64_t a, uint64_t b, uint64_t *high) {
+  uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+  uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+  uint64_t b00 = a_lo * b_lo, b01 = a_lo * b_hi, b10 = a_hi * b_lo, b11 = a_hi * b_hi;
+  uint64_t mid1 = b10 + (b00 >> 32);
+  uint64_t mid2 = b01 + (uint32_t)mid1;
+  *high = b11 + (mid1 >> 32) + (mid2 >> 32);
+  return (mid2 << 32) | (uint32_t)b00;
+}
+
+// (m * mul) >> j, where mul is a 128-bit table entry and 64 < j < 128
+static inline uint64_t sdm_ryu_mul_shift(uint64_t m, const uint64_t *mul, int32_t j) {
+  uint64_t high0, high1;
+  sdm_umul128(m, mul[0], &high0);
+  uint64_t low1 = sdm_umul128(m, mul[1], &high1);
+  uint64_t sum = low1 + high0;
+  high1 += sum < high0;
+  int32_t shift = j - 64;
+  return (sum >> shift) | (high1 << (64 - shift));
+}
+
+static inline int32_t sdm_ryu_pow5_bits(int32_t e) {
+  // ceil(log2(5^e)) for e >= 1, and 1 for e == 0
+  return (int32_t)((((uint32_t)e * 1217359) >> 19) + 1);
+}
+
+static inline uint32_t sdm_ryu_log10_pow2(int32_t e) { return ((uint32_t)e * 78913) >> 18; }
+static inline uint32_t sdm_ryu_log10_pow5(int32_t e) { return ((uint32_t)e * 732923) >> 20; }
+
+static inline bool sdm_ryu_multiple_of_pow5(uint64_t value, uint32_t p) {
+  uint32_t count = 0;
+  while (value % 5 == 0) {
+    value /= 5;
+    count++;
+  }
+  return count >= p;
+}
+
+static inline bool sdm_ryu_multiple_of_pow2(uint64_t value, uint32_t p) {
+  return (value & ((1ull << p) - 1)) == 0;
+}
+
+// The shortest decimal mantissa * 10^exponent that reads back as the double with these bits,
+// and of those the closest
+static uint64_t sdm_ryu_shortest(uint64_t ieee_mantissa, uint32_t ieee_exponent, int32_t *exponent) {
+  int32_t e2;
+  uint64_t m2;
+  if (ieee_exponent == 0) {
+    e2 = 1 - 1023 - 52 - 2;
+    m2 = ieee_mantissa;
+  } else {
+    e2 = (int32_t)ieee_exponent - 1023 - 52 - 2;
+    m2 = (1ull << 52) | ieee_mantissa;
+  }
+  bool accept_bounds = (m2 & 1) == 0;
+
+  // The value and its halfway points to the neighbouring doubles, times 4 so they are integers.
+  // The lower neighbour is closer when the mantissa is at a power of two.
+  uint64_t mv = 4 * m2;
+  uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+
+  // Scale all three by 10^-e10, noting whether anything non-zero was shifted out
+  uint64_t vr, vp, vm;
+  int32_t e10;
+  bool vm_trailing_zeros = false;
+  bool vr_trailing_zeros = false;
+  if (e2 >= 0) {
+    uint32_t q = sdm_ryu_log10_pow2(e2) - (e2 > 3);
+    e10 = (int32_t)q;
+    int32_t k = SDM_RYU_POW5_INV_BITCOUNT + sdm_ryu_pow5_bits((int32_t)q) - 1;
+    int32_t i = -e2 + (int32_t)q + k;
+    vr = sdm_ryu_mul_shift(4 * m2, sdm_ryu_pow5_inv_split[q], i);
+    vp = sdm_ryu_mul_shift(4 * m2 + 2, sdm_ryu_pow5_inv_split[q], i);
+    vm = sdm_ryu_mul_shift(4 * m2 - 1 - mm_shift, sdm_ryu_pow5_inv_split[q], i);
+    if (q <= 21) {
+      if (mv % 5 == 0) vr_trailing_zeros = sdm_ryu_multiple_of_pow5(mv, q);
+      else if (accept_bounds) vm_trailing_zeros = sdm_ryu_multiple_of_pow5(mv - 1 - mm_shift, q);
+      else vp -= sdm_ryu_multiple_of_pow5(mv + 2, q);
+    }
+  } else {
+    uint32_t q = sdm_ryu_log10_pow5(-e2) - (-e2 > 1);
+    e10 = (int32_t)q + e2;
+    int32_t i = -e2 - (int32_t)q;
+    int32_t k = sdm_ryu_pow5_bits(i) - SDM_RYU_POW5_BITCOUNT;
+    int32_t j = (int32_t)q - k;
+    vr = sdm_ryu_mul_shift(4 * m2, sdm_ryu_pow5_split[i], j);
+    vp = sdm_ryu_mul_shift(4 * m2 + 2, sdm_ryu_pow5_split[i], j);
+    vm = sdm_ryu_mul_shift(4 * m2 - 1 - mm_shift, sdm_ryu_pow5_split[i], j);
+    if (q <= 1) {
+      // mv has at least q trailing zero bits
+      vr_trailing_zeros = true;
+      if (accept_bounds) vm_trailing_zeros = mm_shift == 1;
+      else vp--;
+    } else if (q < 63) {
+      vr_trailing_zeros = sdm_ryu_multiple_of_pow2(mv, q);
+    }
+  }
+
+  // Drop digits while the bounds still differ, tracking the last digit dropped from vr for rounding
+  int32_t removed = 0;
+  uint64_t output;
+  if (vm_trailing_zeros || vr_trailing_zeros) {
+    uint32_t last_removed = 0;
+    while (vp / 10 > vm / 10) {
+      vm_trailing_zeros &= vm % 10 == 0;
+      vr_trailing_zeros &= last_removed == 0;
+      last_removed = vr % 10;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+    if (vm_trailing_zeros) {
+      while (vm % 10 == 0) {
+        vr_trailing_zeros &= last_removed == 0;
+        last_removed = vr % 10;
+        vr /= 10;
+        vp /= 10;
+        vm /= 10;
+        removed++;
+      }
+    }
+    // An exact ...5 rounds to even
+    if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0) last_removed = 4;
+    output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed >= 5);
+  } else {
+    // The common case, where the bounds can't be exact
+    bool round_up = false;
+    if (vp / 100 > vm / 100) {
+      round_up = vr % 100 >= 50;
+      vr /= 100;
+      vp /= 100;
+      vm /= 100;
+      removed += 2;
+    }
+    while (vp / 10 > vm / 10) {
+      round_up = vr % 10 >= 5;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+    output = vr + (vr == vm || round_up);
   }
-  hash += hash << 3;
-  hash ^= hash >> 11;
-  hash += hash << 15;
-  return hash;
+
+  *exponent = e10 + removed;
+  return output;
+}
+
+size_t sdm_format_double(double value, char *out) {
+  // The shortest decimal that strtod reads back as value.  It is written out in full with a
+  // ".0" or fraction when it is a short decimal (m / 10^k with m < 2^53 and k <= 17), which is
+  // most values in practice, and otherwise the way %g would write that many digits.
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint64_t ieee_mantissa = bits & ((1ull << 52) - 1);
+  uint32_t ieee_exponent = (uint32_t)(bits >> 52) & 0x7ff;
+
+  if (ieee_exponent == 0x7ff && ieee_mantissa != 0) {
+    memcpy(out, "nan", 3);
+    return 3;
+  }
+
+  size_t length = 0;
+  if (bits >> 63) out[length++] = '-';
+  if (ieee_exponent == 0x7ff) {
+    memcpy(out + length, "inf", 3);
+    return length + 3;
+  }
+  if (ieee_exponent == 0 && ieee_mantissa == 0) {
+    memcpy(out + length, "0.0", 3);
+    return length + 3;
+  }
+
+  int32_t exponent;
+  uint64_t mantissa = sdm_ryu_shortest(ieee_mantissa, ieee_exponent, &exponent);
+  while (mantissa % 10 == 0) {
+    mantissa /= 10;
+    exponent++;
+  }
+  char digits[24];
+  int32_t n = (int32_t)sdm_format_int((int64_t)mantissa, digits);
+
+  if (exponent >= 0 && exponent + n <= 16) {
+    uint64_t whole = mantissa;
+    for (int32_t z=0; z<exponent; z++) whole *= 10;
+    if (whole < (1ull << 53)) {
+      memcpy(out + length, digits, n);
+      length += n;
+      for (int32_t z=0; z<exponent; z++) out[length++] = '0';
+      memcpy(out + length, ".0", 2);
+      return length + 2;
+    }
+  }
+
+  int32_t point = n + exponent;  // Digits before the decimal point
+  bool short_decimal = exponent < 0 && exponent >= -17 && mantissa < (1ull << 53);
+  int32_t scientific = point - 1;
+  if (!short_decimal && (scientific < -4 || scientific >= n)) {
+    out[length++] = digits[0];
+    if (n > 1) {
+      out[length++] = '.';
+      memcpy(out + length, digits + 1, n - 1);
+      length += n - 1;
+    }
+    out[length++] = 'e';
+    out[length++] = scientific < 0 ? '-' : '+';
+    if (scientific < 0) scientific = -scientific;
+    if (scientific < 10) out[length++] = '0';
+    return length + sdm_format_int(scientific, out + length);
+  }
+
+  if (point <= 0) {
+    out[length++] = '0';
+    out[length++] = '.';
+    for (int32_t z=point; z<0; z++) out[length++] = '0';
+    memcpy(out + length, digits, n);
+    return length + n;
+  }
+  memcpy(out + length, digits, point);
+  length += point;
+  if (point < n) {
+    out[length++] = '.';
+    memcpy(out + length, digits + point, n - point);
+    length += n - point;
+  }
+  return length;
 }
 
 void sdm_arena_init(sdm_arena_t *arena, size_t capacity) {
@@ -190,12 +803,15 @@ void *sdm_arena_alloc(sdm_arena_t *arena, size_t size) {
     sdm_arena_init(arena, capacity);
   }
 
-  if (arena->capacity - arena->length < size) {
+  size_t offset = (arena->length + SDM_ARENA_ALIGNMENT - 1) & ~(size_t)(SDM_ARENA_ALIGNMENT - 1);
+  if (offset > arena->capacity || arena->capacity - offset < size) {
     if (arena->next->capacity == 0) arena->next->capacity = arena->capacity;
     return sdm_arena_alloc(arena->next, size);
   }
 
+  arena->length = offset;
   void *return_val = (char*)arena->start + arena->length;
+  arena->last = arena->length;
 
   if (size > 0)
     arena->length += size;
@@ -206,8 +822,28 @@ void *sdm_arena_alloc(sdm_arena_t *arena, size_t size) {
 }
 
 void *sdm_arena_realloc(sdm_arena_t *arena, void *ptr, size_t size) {
+  if (ptr == NULL) return sdm_arena_alloc(arena, size);
+
+  sdm_arena_t *block = arena;
+  while (block->start != NULL &&
+         !((char*)ptr >= (char*)block->start && (char*)ptr < (char*)block->start + block->length)) {
+    block = block->next;
+  }
+  if (block->start == NULL) {
+    fprintf(stderr, "Tried to realloc memory that is not in the arena. Aborting.\n");
+    exit(1);
+  }
+
+  // A growing array is usually the last thing allocated, so it can simply be extended
+  if ((char*)ptr == (char*)block->start + block->last && block->last + size <= block->capacity) {
+    block->length = block->last + (size > 0 ? size : 1);
+    return ptr;
+  }
+
+  // The old size isn't recorded, but it can't extend past the end of the block's used region
+  size_t available = (char*)block->start + block->length - (char*)ptr;
   void *retval = sdm_arena_alloc(arena, size);
-  if (ptr) memcpy(retval, ptr, size);
+  memcpy(retval, ptr, size < available ? size : available);
   return retval;
 }
 
@@ -226,10 +862,7 @@ void sdm_arena_free(sdm_arena_t *arena) {
 
 bool sdm_sv_compare(sdm_string_view SV1, sdm_string_view SV2) {
   if (SV1.length != SV2.length) return false;
-  for (size_t i=0; i<SV1.length; i++) {
-    if (SV1.data[i] != SV2.data[i]) return false;
-  }
-  return true;
+  return memcmp(SV1.data, SV2.data, SV1.length) == 0;
 }
 
 
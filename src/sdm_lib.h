@@ -4,7 +4,8 @@
 /* This library provides the following:
  *
  * char *sdm_shift_args(int *argc, char ***argv);      Peel arguments off the **argv array typically provided to main, decrementing argc appropriately.
- * char *sdm_read_entire_file(const char *file_path);  Read the contents of a file into a character array. This character array is malloc'ed and so should be freed by the user.
+ * char *sdm_read_entire_file(const char *file_path);  Read the contents of a file into a character array, followed by SDM_INPUT_PADDING zero bytes. This character array is malloc'ed and so should be freed by the user.
+ * char *sdm_pad_string(const char *data, size_t len); Copy len bytes into a new buffer followed by SDM_INPUT_PADDING zero bytes.
  * SDM_FREE_AND_NULL(ptr)                              Free the memory pointed to by ptr, and then set ptr to NULL.
  * #define SDM_FREE SDM_FREE_AND_NULL
  * #define SDM_MALLOC malloc
@@ -27,20 +28,53 @@
  * void sdm_sv_trim(sdm_string_view *SV);                                      Trim any whitespace from the start of the string view
  * SDM_SV_F "%.*s"                                                             A printf helper.
  * SDM_SV_Vals(S) (int)(S).length, (S).data                                    A printf helper.
+ * sdm_is_id_start / sdm_is_id_char / sdm_is_digit / sdm_is_space / sdm_is_punct  Locale-free character classification by table lookup.
+ * sdm_char_masks sdm_classify_block(const char *data);                       Which of the 16 bytes at data are identifier characters and which are whitespace (SIMD when available).
+ * size_t sdm_skip_id_chars(const char *data, size_t index);                  Index of the first byte at or after index that is not [A-Za-z0-9_] (SIMD when available). Needs a padded buffer.
+ * 
+ * # HASHMAPS
+ * ==========
+ * DblArray                                                                    Open-addressing map from string views to doubles.
+ * void push_to_dblarray(DblArray *hm, sdm_string_view key, double value);    Insert or overwrite the value stored under key. The key is not copied.
+ * bool get_from_dblarray(const DblArray *hm, sdm_string_view key, double *v); Look up key, returning false if it is not present.
+ * uint64_t sdm_sv_hash(sdm_string_view sv);                                   The hash used for all hashmap keys.
+ * uint64_t sdm_hash_bytes(const void *data, size_t length);                   Word-at-a-time (wyhash-style) hash of a block of memory.
+ * GET_HASHMAP_INDEX / PUSH_TO_HASHMAP / HM_VAL_AT                             Generic helpers for any struct with `index` and `values` members.
+ * uint32_t sdm_intern(sdm_interner *in, sdm_string_view name, uint64_t hash); Return the dense id of name, adding it if it is new.
+ * sdm_string_view sdm_interned_name(const sdm_interner *in, uint32_t id);     The (NUL-terminated) spelling of an interned id.
+ * sdm_concurrent_intern(...) / sdm_concurrent_interner_canonicalise(...)      Thread-safe interning with deterministic ids after a merge.
+ * 
+ * # WORK-STEALING DEQUES
+ * ======================
+ * sdm_ws_deque_init / sdm_ws_deque_push / sdm_ws_deque_take   The owning thread pushes and takes at the bottom.
+ * bool sdm_ws_deque_steal(sdm_ws_deque *deque, uint32_t *item) Any other thread takes from the top. Fails (returns false) when empty or when it loses a race.
+ * 
+ * # BUFFERED WRITER
+ * =================
+ * void sdm_writer_init(sdm_writer *writer, FILE *stream);    Start buffering output to stream.
+ * void sdm_write_int / sdm_write_double / sdm_write_sv(...)  Append a formatted value. Doubles use the shortest round-trip form.
+ * void sdm_writer_flush(sdm_writer *writer);                 Write out anything still buffered.
  * 
  * # MEMORY ARENA
  * ==============
  * #define SDM_ARENA_DEFAULT_CAP 256 * 1024*1024              Default capacity of the memory arena when not supplied by the user
  * void sdm_arena_init(sdm_arena_t *arena, size_t capacity);  Initialise a memory arena with a certain capacity and malloc the required space.
  * void *sdm_arena_alloc(sdm_arena_t *arena, size_t size);    Allocate a region of size bytes in the given arena, and return a pointer to the start of this region.
+ * void *sdm_arena_realloc(sdm_arena_t *arena, void *ptr, size_t size);  Resize a region, in place if it was the most recent allocation in its block.
  * void sdm_arena_free(sdm_arena_t *arena);                   Deallocate all memory in the arena, and zero everything
  */
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define SDM_FREE_AND_NULL(ptr) \
 do {                           \
   if ((ptr)) free((ptr));      \
@@ -51,12 +85,12 @@ do {                           \
 #ifndef SDM_MALLOC
 void *active_alloc(size_t size);
 void *active_realloc(void *ptr, size_t size);
+// Makes arena the one the calling thread allocates from, returning the previous one
+struct sdm_arena_t *active_swap_arena(struct sdm_arena_t *arena);
 #define SDM_MALLOC active_alloc
 #define SDM_REALLOC active_realloc
 #endif
 
-#define hash jenkins_one_at_a_time_hash
-
 #define SDM_ENSURE_ARRAY_CAP(da, cap) do {                     \
     (da).capacity = cap;                                       \
     (da).data = SDM_REALLOC((da).data,                             \
@@ -128,12 +162,71 @@ typedef struct {
   char *data;
 } sdm_string_view;
 
+// Locale-independent ASCII character classes, looked up in a 256-entry table.
+// Bytes outside ASCII belong to no class.
+#define SDM_CHAR_ID_START 0x01  // [A-Za-z]
+#define SDM_CHAR_ID_CONT  0x02  // [A-Za-z0-9_]
+#define SDM_CHAR_DIGIT    0x04  // [0-9]
+#define SDM_CHAR_SPACE    0x08  // ' ', \t, \n, \v, \f, \r
+#define SDM_CHAR_PUNCT    0x10  // Printable characters that are none of the above
+
+extern const uint8_t sdm_char_class[256];
+
+static inline bool sdm_is_id_start(char c) { return sdm_char_class[(unsigned char)c] & SDM_CHAR_ID_START; }
+static inline bool sdm_is_id_char(char c)  { return sdm_char_class[(unsigned char)c] & SDM_CHAR_ID_CONT; }
+static inline bool sdm_is_digit(char c)    { return sdm_char_class[(unsigned char)c] & SDM_CHAR_DIGIT; }
+static inline bool sdm_is_space(char c)    { return sdm_char_class[(unsigned char)c] & SDM_CHAR_SPACE; }
+static inline bool sdm_is_punct(char c)    { return sdm_char_class[(unsigned char)c] & SDM_CHAR_PUNCT; }
+
+// Bit i of id (space) is set if data[i] is an identifier character (whitespace), as
+// sdm_is_id_char (sdm_is_space) would say, for the 16 bytes from data.  This is the
+// one place the lexer's byte classes are worked out a block at a time.
+#define SDM_CLASSIFY_BLOCK 16
+
+typedef struct {
+  unsigned id;
+  unsigned space;
+} sdm_char_masks;
+
+static inline sdm_char_masks sdm_classify_block(const char *data) {
+#ifdef __SSE2__
+  // OR-ing in 0x20 folds A-Z onto a-z without moving any other byte into that range.
+  // The compares are signed, so bytes >= 0x80 are below every bound and match nothing.
+  __m128i bytes  = _mm_loadu_si128((const __m128i*)data);
+  __m128i folded = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+  __m128i alpha  = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+  __m128i digit  = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+  __m128i is_id  = _mm_or_si128(_mm_or_si128(alpha, digit), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')));
+  __m128i blank  = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('\t' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('\r' + 1)));
+  __m128i is_space = _mm_or_si128(blank, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+  return (sdm_char_masks){
+    .id = (unsigned)_mm_movemask_epi8(is_id),
+    .space = (unsigned)_mm_movemask_epi8(is_space),
+  };
+#else
+  sdm_char_masks masks = {0};
+  for (unsigned i=0; i<SDM_CLASSIFY_BLOCK; i++) {
+    if (sdm_is_id_char(data[i])) masks.id |= 1u << i;
+    if (sdm_is_space(data[i])) masks.space |= 1u << i;
+  }
+  return masks;
+#endif
+}
+
+size_t sdm_skip_id_chars(const char *data, size_t index);
+
 #define SDM_SV_F "%.*s"
 #define SDM_SV_Vals(S) (int)(S).length, (S).data
 
 char *sdm_shift_args(int *argc, char ***argv);
 
+// Input buffers handed to the lexer end in at least this many zero bytes.  The
+// first acts as a sentinel that stops every scanning loop without a separate
+// length check, and the rest make it safe for SIMD loads to run past the end.
+#define SDM_INPUT_PADDING 64
+
 char *sdm_read_entire_file(const char *file_path);
+char *sdm_pad_string(const char *data, size_t length);
 
 sdm_string_view sdm_cstr_as_sv(char *cstr);
 char *sdm_sv_to_cstr(sdm_string_view sv);
@@ -147,103 +240,202 @@ void sdm_sv_trim(sdm_string_view *SV);
 int sdm_svncmp(sdm_string_view SV, const char *cmp);
 bool sdm_sv_compare(sdm_string_view SV1, sdm_string_view SV2);
 
-typedef struct {
-  char key[32];
-  double value;
-  bool occupied;
-} Dbl_KVPair;
+// Word-at-a-time hashing in the style of wyhash.  Input is consumed as 64-bit
+// little-endian words, each folded into the state with one 64x64->128 multiply.
+#define SDM_HASH_P0 0xa0761d6478bd642full
+#define SDM_HASH_P1 0xe7037ed1a0b428dbull
+#define SDM_HASH_P2 0x8ebc6af09c88c6e3ull
+
+static inline uint64_t sdm_hash_mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  __extension__ unsigned __int128 r = (unsigned __int128)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+  return lo ^ hi;
+#endif
+}
 
+uint64_t sdm_hash_bytes(const void *data, size_t length);
+
+// Open-addressing hashmaps keyed on string views.  The slot bookkeeping lives in
+// sdm_hm_index and is shared by every map; a map is any struct with an `index`
+// member and a `values` array running parallel to the slots.  The capacity is
+// always a power of two so slots are found by masking the hash.  Each slot has a
+// control byte that is SDM_HM_EMPTY or the top seven bits of the full hash with
+// the high bit set, so most probes that miss never touch the stored hash or key.
+// Keys are not copied: the memory they point at must outlive the map.
 typedef struct {
-  Dbl_KVPair *data;
+  uint8_t *ctrl;
+  uint64_t *hashes;
+  sdm_string_view *keys;
   size_t length;
   size_t capacity;
-} DblArray;
+} sdm_hm_index;
 
 #define DEFAULT_HM_CAP 256
 
-#define SET_HM_CAPACITY(hm, cap)                                              \
-  do {                                                                        \
-    (hm)->capacity = (cap);                                                   \
-    if ((hm)->data == NULL) {                                                 \
-      (hm)->data = SDM_MALLOC(hm->capacity * sizeof(hm->data[0]));                \
-    }                                                                         \
-    else {                                                                    \
-      (hm)->data = SDM_REALLOC((hm)->data, (hm)->capacity * sizeof(hm->data[0])); \
-    }                                                                         \
-    if ((hm)->data == NULL) {                                                 \
-      fprintf(stderr, "ERR: Can't alloc.\n");                                 \
-      exit(1);                                                                \
-    }                                                                         \
-    memset((hm)->data, 0, (hm)->capacity * sizeof(hm->data[0]));              \
+#define SDM_HM_EMPTY 0x00
+#define SDM_HM_TAG(hash) ((uint8_t)(0x80 | ((hash) >> 57)))
+
+// Keep at least one slot in eight empty so that a miss always stops quickly
+#define SDM_HM_NEEDS_GROW(index) \
+  (((index).length + 1) * 8 > (index).capacity * 7)
+
+typedef struct {
+  sdm_hm_index index;
+  double *values;
+} DblArray;
+
+#define SET_HM_CAPACITY(hm, cap)                                               \
+  do {                                                                         \
+    sdm_hm_index_init(&(hm)->index, (cap));                                    \
+    (hm)->values = SDM_MALLOC((hm)->index.capacity * sizeof((hm)->values[0])); \
+    if ((hm)->values == NULL) {                                                \
+      fprintf(stderr, "ERR: Can't alloc.\n");                                  \
+      exit(1);                                                                 \
+    }                                                                          \
   } while (0)
 
-#define FREE_HASHMAP(hm) \
-  do {                   \
-    (hm).capacity = 0;   \
-    SDM_FREE((hm).data);     \
+#define FREE_HASHMAP(hm)         \
+  do {                           \
+    SDM_FREE((hm).index.ctrl);   \
+    SDM_FREE((hm).index.hashes); \
+    SDM_FREE((hm).index.keys);   \
+    SDM_FREE((hm).values);       \
+    (hm).index.length = 0;       \
+    (hm).index.capacity = 0;     \
   } while (0);
 
-#define GET_HASHMAP_INDEX(hm, value_of_key, index_addr)                      \
-  do {                                                                       \
-    *(index_addr) = -1;                                                      \
-    uint32_t location = get_hashmap_location((value_of_key), (hm).capacity); \
-    for (size_t offset=0; offset<(hm).capacity; offset++) {                  \
-      int new_location = (location + offset) % (hm).capacity;                \
-      if ((hm).data[new_location].occupied &&                                \
-        (strcmp((hm).data[new_location].key, (value_of_key))==0)) {          \
-        *(index_addr) = new_location;                                        \
-        break;                                                               \
-      }                                                                      \
-    }                                                                        \
+#define GET_HASHMAP_INDEX(hm, key_sv, key_hash, index_addr)         \
+  do {                                                              \
+    *(index_addr) = sdm_hm_find(&(hm).index, (key_sv), (key_hash)); \
   } while (0)
 
 #define HM_VAL_AT(hm, index) \
-  (hm).data[index].value
-
-#define PUSH_TO_HASHMAP(hm1, value_of_key, value_of_value)                                   \
-  do {                                                                                       \
-    uint32_t location;                                                                       \
-    if ((hm1)->capacity == 0) {                                                              \
-      SET_HM_CAPACITY((hm1), DEFAULT_HM_CAP);                                                \
-    }                                                                                        \
-    if ((hm1)->length >= (hm1)->capacity) {                                                  \
-      fprintf(stderr, "Hashmap has insufficient capacity.\n");                               \
-      exit(1);                                                                               \
-    }                                                                                        \
-    location = get_hashmap_location((value_of_key), (hm1)->capacity);                        \
-                                                                                             \
-    if (!(hm1)->data[location].occupied ||                                                   \
-      ((hm1)->data[location].occupied && strcmp((value_of_key), (hm1)->data[location].key)==0)) {  \
-      strcpy((hm1)->data[location].key, (value_of_key));                                     \
-      (hm1)->data[location].value = (value_of_value);                                        \
-      (hm1)->data[location].occupied = true;                                                 \
-      (hm1)->length++;                                                                       \
-    } else {                                                                                 \
-      for (size_t i=1; i<(hm1)->capacity; i++) {                                             \
-        size_t new_location = (location + i) % (hm1)->capacity;                              \
-        if (!(hm1)->data[new_location].occupied ||                                           \
-          ((hm1)->data[new_location].occupied && strcmp((value_of_key), (hm1)->data[new_location].key)==0)) { \
-          strcpy((hm1)->data[new_location].key, (value_of_key));                             \
-          (hm1)->data[new_location].value = (value_of_value);                                \
-          (hm1)->data[new_location].occupied = true;                                         \
-          (hm1)->length++;                                                                   \
-          break;                                                                             \
-        }                                                                                    \
-      }                                                                                      \
-    }                                                                                        \
+  (hm).values[index]
+
+#define PUSH_TO_HASHMAP(hm, key_sv, key_hash, value_of_value)                          \
+  do {                                                                                 \
+    if ((hm)->index.capacity == 0) {                                                   \
+      SET_HM_CAPACITY((hm), DEFAULT_HM_CAP);                                           \
+    } else if (SDM_HM_NEEDS_GROW((hm)->index)) {                                       \
+      (hm)->values = sdm_hm_grow(&(hm)->index, (hm)->values, sizeof((hm)->values[0])); \
+    }                                                                                  \
+    size_t slot = sdm_hm_insert_slot(&(hm)->index, (key_sv), (key_hash), NULL);        \
+    (hm)->values[slot] = (value_of_value);                                             \
   } while (0)
 
-void push_to_dblarray(DblArray *hm, char *key, double value);
-uint32_t get_hashmap_location(const char* key, size_t capacity);
-uint32_t jenkins_one_at_a_time_hash(const uint8_t* key, size_t length);
+uint64_t sdm_sv_hash(sdm_string_view sv);
+void sdm_hm_index_init(sdm_hm_index *index, size_t capacity);
+int64_t sdm_hm_find(const sdm_hm_index *index, sdm_string_view key, uint64_t hash);
+size_t sdm_hm_insert_slot(sdm_hm_index *index, sdm_string_view key, uint64_t hash, bool *existed);
+void *sdm_hm_grow(sdm_hm_index *index, void *values, size_t value_size);
+
+void push_to_dblarray(DblArray *hm, sdm_string_view key, double value);
+bool get_from_dblarray(const DblArray *hm, sdm_string_view key, double *value);
+
+// Interns string views, handing out dense ids in order of first appearance.
+// Each distinct name is copied once (NUL-terminated) and the map keys point at
+// that copy, so the caller's buffer need not outlive the interner.
+typedef struct {
+  size_t capacity;
+  size_t length;
+  sdm_string_view *data;
+} sdm_sv_array;
+
+typedef struct {
+  sdm_hm_index index;
+  uint32_t *values;
+  sdm_sv_array names;
+} sdm_interner;
+
+uint32_t sdm_intern(sdm_interner *interner, sdm_string_view name, uint64_t hash);
+bool sdm_interner_find(const sdm_interner *interner, sdm_string_view name, uint64_t hash, uint32_t *id);
+sdm_string_view sdm_interned_name(const sdm_interner *interner, uint32_t id);
+
+// A fixed-capacity interner that many threads can use at once.  It uses the
+// same probing and tag scheme as sdm_hm_index, but each slot is a single atomic
+// word holding the tag and the entry id, so lookups never lock and inserts claim
+// an empty slot with one compare-and-swap.  An id is only taken once its slot has
+// been claimed (anyone meeting the slot with the same tag in the meantime waits the
+// few stores it takes to fill in), so no id is wasted on a lost race and max_names
+// need only be the number of distinct names.  The ids it hands out depend on how
+// the threads interleave; sdm_concurrent_interner_canonicalise then renumbers
+// the names by the earliest source offset each was seen at, which gives the same
+// ids as interning the input sequentially.  Names are views into the caller's
+// buffer and are only copied during canonicalisation.
+typedef struct {
+  sdm_string_view name;
+  uint64_t hash;
+  _Atomic size_t first_offset;
+} sdm_concurrent_entry;
+
+typedef struct {
+  _Atomic uint64_t *slots;
+  size_t slot_capacity;
+  sdm_concurrent_entry *entries;
+  size_t entry_capacity;
+  _Atomic uint32_t next_id;
+} sdm_concurrent_interner;
+
+void sdm_concurrent_interner_init(sdm_concurrent_interner *interner, size_t max_names);
+uint32_t sdm_concurrent_intern(sdm_concurrent_interner *interner, sdm_string_view name, uint64_t hash, size_t offset);
+bool sdm_concurrent_find(const sdm_concurrent_interner *interner, sdm_string_view name, uint64_t hash, uint32_t *id);
+void sdm_concurrent_interner_canonicalise(const sdm_concurrent_interner *interner, sdm_interner *target, uint32_t *remap);
+
+// A Chase-Lev work-stealing deque of 32-bit items.  The thread that owns it pushes
+// and takes at the bottom, without contention in the common case; other threads
+// steal from the top.  The capacity is fixed: it must be at least the number of
+// items ever held at once.
+typedef struct {
+  _Atomic int64_t top;
+  _Atomic int64_t bottom;
+  _Atomic uint32_t *items;
+  int64_t mask;
+} sdm_ws_deque;
+
+void sdm_ws_deque_init(sdm_ws_deque *deque, size_t capacity);
+void sdm_ws_deque_push(sdm_ws_deque *deque, uint32_t item);
+bool sdm_ws_deque_take(sdm_ws_deque *deque, uint32_t *item);
+bool sdm_ws_deque_steal(sdm_ws_deque *deque, uint32_t *item);
+
+// Buffered output with hand-rolled number formatting, for writing large amounts
+// of text without going through printf for every field.  Doubles are written as
+// the shortest decimal that reads back (with strtod) as the same value.
+#define SDM_WRITER_CAP (64 * 1024)
+
+typedef struct {
+  FILE *stream;
+  size_t length;
+  char buffer[SDM_WRITER_CAP];
+} sdm_writer;
+
+void sdm_writer_init(sdm_writer *writer, FILE *stream);
+void sdm_writer_flush(sdm_writer *writer);
+void sdm_write_bytes(sdm_writer *writer, const char *data, size_t length);
+void sdm_write_cstr(sdm_writer *writer, const char *cstr);
+void sdm_write_sv(sdm_writer *writer, sdm_string_view sv);
+void sdm_write_int(sdm_writer *writer, int64_t value);
+void sdm_write_double(sdm_writer *writer, double value);
+size_t sdm_format_int(int64_t value, char *out);
+size_t sdm_format_double(double value, char *out);
 
 #define SDM_ARENA_DEFAULT_CAP 128 * 1024*1024
+#define SDM_ARENA_ALIGNMENT 16
 
 typedef struct sdm_arena_t sdm_arena_t;
 
 struct sdm_arena_t {
   size_t length;
   size_t capacity;
+  size_t last;  // Offset of the most recent allocation, which realloc can grow in place
   void *start;
   sdm_arena_t *next;
 };
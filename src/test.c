@@ -1,27 +1,80 @@
 #include <stdio.h>
+#include <threads.h>
 
 #include "sdm_lib.h"
 
 #define EXTERN
 #include "token_lib.h"
+#include "ast_lib.h"
+#include "eval_lib.h"
+#include "vm_lib.h"
+#include "line_lib.h"
 
 static sdm_arena_t main_arena = {0};
-static sdm_arena_t *active_arena = &main_arena;
+static _Thread_local sdm_arena_t *active_arena = &main_arena;
 
 void *active_alloc(size_t size)              { return sdm_arena_alloc(active_arena, size); }
 void *active_realloc(void *ptr, size_t size) { return sdm_arena_realloc(active_arena, ptr, size); }
 
+sdm_arena_t *active_swap_arena(sdm_arena_t *arena) {
+  sdm_arena_t *previous = active_arena;
+  active_arena = arena;
+  return previous;
+}
+
 bool compare_files(const char *testname, const char *filename1, const char *filename2);
 
 typedef bool (*TestFunction)(void);
 bool test_comments(void);
 bool test_comments_and_numbers(void);
 bool test_general_text(void);
+bool test_hashmap(void);
+bool test_hashing(void);
+bool test_symbols(void);
+bool test_concurrent_interner(void);
+bool test_keywords(void);
+bool test_id_scan(void);
+bool test_token_estimate(void);
+bool test_token_list(void);
+bool test_parallel_lexing(void);
+bool test_token_stream(void);
+bool test_lazy_numbers(void);
+bool test_string_escapes(void);
+bool test_diagnostics(void);
+bool test_float_format(void);
+bool test_ast(void);
+bool test_evaluator(void);
+bool test_vm(void);
+bool test_invalidation(void);
+bool test_parallel_eval(void);
+bool test_jobs_output(void);
+bool test_lines(void);
 
 TestFunction tests[] = {
   test_comments,
   test_comments_and_numbers,
   test_general_text,
+  test_hashmap,
+  test_hashing,
+  test_symbols,
+  test_concurrent_interner,
+  test_keywords,
+  test_id_scan,
+  test_token_estimate,
+  test_token_list,
+  test_parallel_lexing,
+  test_token_stream,
+  test_lazy_numbers,
+  test_string_escapes,
+  test_diagnostics,
+  test_float_format,
+  test_ast,
+  test_evaluator,
+  test_vm,
+  test_invalidation,
+  test_parallel_eval,
+  test_jobs_output,
+  test_lines,
 };
 
 int main(void) {
@@ -66,20 +119,10 @@ bool test_general_text(void) {
     return false;
   }
 
-  for (size_t i=0; i<token_array.length; i++) {
-    Token token = token_array.data[i];
-    fprintf(output, "%d :: ", token_array.data[i].token_type);
-    if (token.token_type == TOKEN_TYPE_STRING) {
-      fprintf(output, "%s", token.as.str_token.value);
-    } else if (token.token_type == TOKEN_TYPE_INT) {
-      fprintf(output, "%ld", token.as.int_token.value);
-    } else if (token.token_type == TOKEN_TYPE_FLOAT) {
-      fprintf(output, "%f", token.as.float_token.value);
-    } else if (token.token_type == TOKEN_TYPE_ID) {
-      fprintf(output, "%s", token.as.id_token.value);
-    }
-    fprintf(output, "\n");
-  }
+  static sdm_writer writer;
+  sdm_writer_init(&writer, output);
+  dump_tokens(&writer, &token_array);
+  sdm_writer_flush(&writer);
 
   fclose(output);
 
@@ -220,6 +263,1425 @@ bool test_comments(void) {
   return comparison_result;
 }
 
+bool test_hashmap(void) {
+  const char *test_name = "HASHMAP TEST";
+  const size_t num_keys = 5000;
+
+  DblArray hm = {0};
+  char *keys = SDM_MALLOC(num_keys * 64);
+  for (size_t i=0; i<num_keys; i++) {
+    // Longer than the old fixed-size key buffer
+    snprintf(&keys[i * 64], 64, "a_rather_long_identifier_for_element_number_%zu", i);
+    push_to_dblarray(&hm, sdm_cstr_as_sv(&keys[i * 64]), (double)i);
+  }
+  push_to_dblarray(&hm, sdm_cstr_as_sv(&keys[42 * 64]), -1.0);
+
+  if (hm.index.length != num_keys) {
+    printf("%s FAILED: expected %zu keys but found %zu\n", test_name, num_keys, hm.index.length);
+    return false;
+  }
+
+  for (size_t i=0; i<num_keys; i++) {
+    double value;
+    double expected = (i == 42) ? -1.0 : (double)i;
+    if (!get_from_dblarray(&hm, sdm_cstr_as_sv(&keys[i * 64]), &value) || value != expected) {
+      printf("%s FAILED: wrong value for key %s\n", test_name, &keys[i * 64]);
+      return false;
+    }
+  }
+
+  double value;
+  if (get_from_dblarray(&hm, sdm_cstr_as_sv("not_a_key"), &value)) {
+    printf("%s FAILED: found a key that was never inserted\n", test_name);
+    return false;
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_hashing(void) {
+  const char *test_name = "HASHING TEST";
+  const char *input_filename = "examples/general_text.txt";
+
+  char *buffer = sdm_read_entire_file(input_filename);
+
+  Parser parser = {
+    .filename = input_filename,
+    .contents = sdm_cstr_as_sv(buffer),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+
+  TokenArray token_array = {0};
+  tokenise_input_file(&parser, &token_array);
+
+  for (size_t i=0; i<token_array.length; i++) {
+    Token token = token_array.data[i];
+    if (token.token_type != TOKEN_TYPE_ID) continue;
+    // The lexer interned the name under sdm_hash_bytes; a lookup through sdm_sv_hash must find the same symbol
+    uint32_t symbol;
+    if (!find_symbol(sdm_cstr_as_sv(token.as.id_token.value), &symbol) || symbol != token.as.id_token.symbol) {
+      printf("%s FAILED: the lexer's symbol for '%s' can't be found again by name\n", test_name, token.as.id_token.value);
+      return false;
+    }
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_symbols(void) {
+  const char *test_name = "SYMBOLS TEST";
+  const char *input_filename = "examples/example.txt";
+
+  char *buffer = sdm_read_entire_file(input_filename);
+
+  Parser parser = {
+    .filename = input_filename,
+    .contents = sdm_cstr_as_sv(buffer),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+
+  TokenArray token_array = {0};
+  tokenise_input_file(&parser, &token_array);
+
+  uint32_t d1;
+  if (!find_symbol(sdm_cstr_as_sv("d1"), &d1)) {
+    printf("%s FAILED: 'd1' was not interned\n", test_name);
+    return false;
+  }
+
+  size_t d1_count = 0;
+  for (size_t i=0; i<token_array.length; i++) {
+    Token token = token_array.data[i];
+    if (token.token_type != TOKEN_TYPE_ID) continue;
+    bool same_name = strcmp(token.as.id_token.value, "d1") == 0;
+    if (same_name != (token.as.id_token.symbol == d1)) {
+      printf("%s FAILED: '%s' has the wrong symbol id\n", test_name, token.as.id_token.value);
+      return false;
+    }
+    if (same_name) {
+      if (token.as.id_token.value != symbol_name(d1).data) {
+        printf("%s FAILED: 'd1' was not shared between occurrences\n", test_name);
+        return false;
+      }
+      d1_count++;
+    }
+  }
+
+  if (d1_count != 3) {
+    printf("%s FAILED: expected 3 occurrences of 'd1' but found %zu\n", test_name, d1_count);
+    return false;
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+typedef struct {
+  sdm_concurrent_interner *interner;
+  TokenArray *tokens;
+  size_t start;
+  uint32_t *ids;
+  _Atomic bool *go;
+} InternWorker;
+
+int intern_worker(void *arg) {
+  // Each worker walks the whole token list from its starting point, once they all can
+  InternWorker *worker = arg;
+  while (!atomic_load(worker->go)) thrd_yield();
+  for (size_t n=0; n<worker->tokens->length; n++) {
+    size_t i = (worker->start + n) % worker->tokens->length;
+    Token token = worker->tokens->data[i];
+    if (token.token_type != TOKEN_TYPE_ID) continue;
+    sdm_string_view name = sdm_cstr_as_sv(token.as.id_token.value);
+    worker->ids[i] = sdm_concurrent_intern(worker->interner, name, sdm_sv_hash(name), token.source.index);
+  }
+  return 0;
+}
+
+bool test_concurrent_interner(void) {
+  const char *test_name = "CONCURRENT INTERNER TEST";
+  const char *input_filename = "examples/example.txt";
+  const size_t num_threads = 8;
+  const size_t num_rounds = 50;
+
+  char *buffer = sdm_read_entire_file(input_filename);
+
+  Parser parser = {
+    .filename = input_filename,
+    .contents = sdm_cstr_as_sv(buffer),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+
+  TokenArray token_array = {0};
+  tokenise_input_file(&parser, &token_array);
+
+  // Canonical ids must match those from interning the tokens in order on one thread
+  sdm_interner sequential = {0};
+  uint32_t *expected = SDM_MALLOC(token_array.length * sizeof(uint32_t));
+  for (size_t i=0; i<token_array.length; i++) {
+    Token token = token_array.data[i];
+    if (token.token_type != TOKEN_TYPE_ID) continue;
+    sdm_string_view name = sdm_cstr_as_sv(token.as.id_token.value);
+    expected[i] = sdm_intern(&sequential, name, sdm_sv_hash(name));
+  }
+
+  // Sized for exactly the distinct names, so that an id lost to a race would run it
+  // out of room.  Half the workers start together at the same place, so that they
+  // race to insert the same names; the others start elsewhere to vary the order.
+  for (size_t round=0; round<num_rounds; round++) {
+    sdm_concurrent_interner interner = {0};
+    sdm_concurrent_interner_init(&interner, sequential.names.length);
+
+    _Atomic bool go = false;
+    thrd_t threads[num_threads];
+    InternWorker workers[num_threads];
+    for (size_t t=0; t<num_threads; t++) {
+      workers[t] = (InternWorker){
+        .interner = &interner,
+        .tokens = &token_array,
+        .start = (t % 2 == 0) ? 0 : (t + round) * token_array.length / num_threads,
+        .ids = SDM_MALLOC(token_array.length * sizeof(uint32_t)),
+        .go = &go,
+      };
+    }
+    for (size_t t=0; t<num_threads; t++) thrd_create(&threads[t], intern_worker, &workers[t]);
+    atomic_store(&go, true);
+    for (size_t t=0; t<num_threads; t++) thrd_join(threads[t], NULL);
+
+    sdm_interner canonical = {0};
+    uint32_t *remap = SDM_MALLOC(sequential.names.length * sizeof(uint32_t));
+    sdm_concurrent_interner_canonicalise(&interner, &canonical, remap);
+
+    for (size_t i=0; i<token_array.length; i++) {
+      Token token = token_array.data[i];
+      if (token.token_type != TOKEN_TYPE_ID) continue;
+      for (size_t t=0; t<num_threads; t++) {
+        if (remap[workers[t].ids[i]] != expected[i]) {
+          printf("%s FAILED: '%s' was given id %u instead of %u\n", test_name, token.as.id_token.value,
+                 remap[workers[t].ids[i]], expected[i]);
+          return false;
+        }
+      }
+    }
+
+    if (canonical.names.length != sequential.names.length) {
+      printf("%s FAILED: expected %zu names but found %zu\n", test_name, sequential.names.length, canonical.names.length);
+      return false;
+    }
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_keywords(void) {
+  const char *test_name = "KEYWORDS TEST";
+  // Every keyword, so that one added to the list (or taken from the element schema) is
+  // checked too, then some near misses
+  char text[1024];
+  size_t length = 0;
+  for (size_t i=1; i<KEYWORD_COUNT; i++) {
+    length += snprintf(text + length, sizeof(text) - length, "%s ", keyword_name(i));
+  }
+  length += snprintf(text + length, sizeof(text) - length, "lets Lin drift Quadd ln");
+  char *input = sdm_pad_string(text, length);
+
+  Parser parser = {
+    .filename = "<keywords>",
+    .contents = sdm_cstr_as_sv(input),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+
+  TokenArray token_array = {0};
+  tokenise_input_file(&parser, &token_array);
+
+  size_t num_keywords = KEYWORD_COUNT - 1;
+  if (token_array.length != num_keywords + 5) {
+    printf("%s FAILED: expected %zu tokens but found %zu\n", test_name, num_keywords + 5, token_array.length);
+    return false;
+  }
+
+  for (size_t i=0; i<num_keywords; i++) {
+    Token token = token_array.data[i];
+    if (token.token_type != TOKEN_TYPE_KEYWORD || token.as.keyword_token.kind != (KeywordKind)(i + 1)) {
+      printf("%s FAILED: '%s' was not recognised as a keyword\n", test_name, keyword_name(i + 1));
+      return false;
+    }
+  }
+
+  for (size_t i=num_keywords; i<num_keywords + 5; i++) {
+    if (token_array.data[i].token_type != TOKEN_TYPE_ID) {
+      printf("%s FAILED: token %zu should be an identifier\n", test_name, i);
+      return false;
+    }
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_id_scan(void) {
+  const char *test_name = "ID SCAN TEST";
+
+  // Every byte value, with long identifier runs of varying length between them
+  char buffer[256 * 40 + SDM_INPUT_PADDING] = {0};
+  size_t length = 0;
+  for (int c=0; c<256; c++) {
+    for (int i=0; i<c % 37; i++) buffer[length++] = "d1_u6_segment_0042"[i % 18];
+    buffer[length++] = (char)c;
+  }
+  buffer[length] = '\0';
+
+  for (size_t start=0; start<length; start++) {
+    size_t expected = start;
+    while (expected < length && sdm_is_id_char(buffer[expected])) expected++;
+    size_t actual = sdm_skip_id_chars(buffer, start);
+    if (actual != expected) {
+      printf("%s FAILED: run starting at %zu should end at %zu, not %zu\n", test_name, start, expected, actual);
+      return false;
+    }
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_token_estimate(void) {
+  const char *test_name = "TOKEN ESTIMATE TEST";
+  const char *input_filenames[] = {
+    "examples/example.txt",
+    "examples/general_text.txt",
+    "examples/comments_and_numbers.txt",
+    "examples/empty_file.txt",
+    "examples/high_bytes.txt",
+  };
+
+  for (size_t i=0; i<SDM_ARRAY_LENGTH(input_filenames); i++) {
+    char *buffer = sdm_read_entire_file(input_filenames[i]);
+
+    Diagnostics diagnostics = {0};  // Not checked here, so keep them off stderr
+    Parser parser = {
+      .filename = input_filenames[i],
+      .contents = sdm_cstr_as_sv(buffer),
+      .col = 1,
+      .line = 1,
+      .index = 0,
+      .diagnostics = &diagnostics,
+    };
+
+    size_t estimate = estimate_token_count(parser.contents);
+
+    TokenArray token_array = {0};
+    tokenise_input_file(&parser, &token_array);
+
+    if (estimate < token_array.length || token_array.capacity != estimate) {
+      printf("%s FAILED: estimated %zu tokens for %s, which has %zu\n", test_name, estimate,
+             input_filenames[i], token_array.length);
+      return false;
+    }
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_token_list(void) {
+  const char *test_name = "TOKEN LIST TEST";
+  const char *input_filename = "examples/example.txt";
+
+  char *buffer = sdm_read_entire_file(input_filename);
+  Parser parser = {
+    .filename = input_filename,
+    .contents = sdm_cstr_as_sv(buffer),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+  TokenArray token_array = {0};
+  tokenise_input_file(&parser, &token_array);
+
+  // Lex the same file several times over so the list spans a few blocks
+  TokenList token_list = {0};
+  Token *first = NULL;
+  size_t repeats = 3 * TOKEN_BLOCK_SIZE / token_array.length + 1;
+  for (size_t r=0; r<repeats; r++) {
+    parser.index = 0;
+    tokenise_input_file_segmented(&parser, &token_list);
+    if (first == NULL) first = token_list_at(&token_list, 0);
+  }
+
+  if (token_list.length != repeats * token_array.length || first != token_list_at(&token_list, 0)) {
+    printf("%s FAILED: expected %zu stable tokens but found %zu\n", test_name,
+           repeats * token_array.length, token_list.length);
+    return false;
+  }
+
+  size_t i = 0;
+  TokenListIterator iter = token_list_iter(&token_list);
+  for (Token *token = token_list_next(&iter); token != NULL; token = token_list_next(&iter), i++) {
+    Token expected = token_array.data[i % token_array.length];
+    if (token->token_type != expected.token_type || token->source.index != expected.source.index) {
+      printf("%s FAILED: token %zu does not match the contiguous array\n", test_name, i);
+      return false;
+    }
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_parallel_lexing(void) {
+  const char *test_name = "PARALLEL LEXING TEST";
+
+  // Plenty of repeated names, strings and comments running over line breaks, stray bytes
+  // for the diagnostics, and one string long enough to swallow whole pieces
+  static char text[1024 * 1024];
+  size_t length = 0;
+  for (size_t i=0; i<6000; i++) {
+    length += snprintf(text + length, sizeof(text) - length, "let name%zu: float = %zu.5 * scale%zu; // a \"comment\n", i % 700, i, i % 3);
+    if (i % 37 == 0) length += snprintf(text + length, sizeof(text) - length, "note = \"over\n  two lines\" @@ `\n");
+    if (i == 3000) {
+      length += snprintf(text + length, sizeof(text) - length, "essay = \"");
+      for (size_t j=0; j<12000; j++) length += snprintf(text + length, sizeof(text) - length, "words words %zu\n", j);
+      length += snprintf(text + length, sizeof(text) - length, "\";\n");
+    }
+  }
+  char *input = sdm_pad_string(text, length);
+
+  for (size_t thread_count=2; thread_count<=8; thread_count+=3) {
+    Diagnostics expected_diagnostics = {0};
+    Parser expected_parser = {
+      .filename = "<parallel>",
+      .contents = sdm_sized_str_as_sv(input, length),
+      .col = 1,
+      .line = 1,
+      .index = 0,
+      .diagnostics = &expected_diagnostics,
+    };
+    reset_symbol_table();
+    TokenArray expected = {0};
+    tokenise_input_file(&expected_parser, &expected);
+    size_t expected_symbols = symbol_count();
+
+    Diagnostics diagnostics = {0};
+    Parser parser = {
+      .filename = "<parallel>",
+      .contents = sdm_sized_str_as_sv(input, length),
+      .col = 1,
+      .line = 1,
+      .index = 0,
+      .diagnostics = &diagnostics,
+    };
+    reset_symbol_table();
+    TokenArray actual = {0};
+    tokenise_input_file_parallel(&parser, &actual, thread_count);
+
+    if (actual.length != expected.length || symbol_count() != expected_symbols ||
+        parser.index != expected_parser.index || parser.line != expected_parser.line || parser.col != expected_parser.col) {
+      printf("%s FAILED: %zu threads found %zu tokens and %zu names, not %zu and %zu\n", test_name, thread_count,
+             actual.length, symbol_count(), expected.length, expected_symbols);
+      return false;
+    }
+    for (size_t i=0; i<expected.length; i++) {
+      const Token *a = &actual.data[i];
+      const Token *e = &expected.data[i];
+      bool same = a->token_type == e->token_type && a->length == e->length && a->source.index == e->source.index &&
+                  a->source.line == e->source.line && a->source.col == e->source.col;
+      if (same && e->token_type == TOKEN_TYPE_ID) {
+        same = a->as.id_token.symbol == e->as.id_token.symbol && strcmp(a->as.id_token.value, e->as.id_token.value) == 0;
+      }
+      if (!same) {
+        printf("%s FAILED: with %zu threads token %zu (line %zu) differs from the sequential lexer's\n", test_name,
+               thread_count, i, e->source.line);
+        return false;
+      }
+    }
+
+    bool same_diagnostics = diagnostics.length == expected_diagnostics.length && diagnostics.dropped == expected_diagnostics.dropped;
+    for (size_t i=0; same_diagnostics && i<diagnostics.length; i++) {
+      same_diagnostics = memcmp(&diagnostics.data[i], &expected_diagnostics.data[i], sizeof(Diagnostic)) == 0;
+    }
+    if (!same_diagnostics) {
+      printf("%s FAILED: with %zu threads the diagnostics differ from the sequential lexer's\n", test_name, thread_count);
+      return false;
+    }
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_token_stream(void) {
+  const char *test_name = "TOKEN STREAM TEST";
+  const char *input_filename = "examples/example.txt";
+
+  char *buffer = sdm_read_entire_file(input_filename);
+  Parser parser = {
+    .filename = input_filename,
+    .contents = sdm_cstr_as_sv(buffer),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+  TokenArray token_array = {0};
+  tokenise_input_file(&parser, &token_array);
+
+  Parser stream_parser = {
+    .filename = input_filename,
+    .contents = sdm_cstr_as_sv(buffer),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+  TokenStream stream;
+  token_stream_init(&stream, &stream_parser);
+
+  for (size_t i=0; i<token_array.length; i++) {
+    // Peek a varying distance ahead before consuming each token
+    size_t k = i % TOKEN_STREAM_LOOKAHEAD;
+    const Token *peeked = token_stream_peek(&stream, k);
+    TokenType expected_type = (i + k < token_array.length) ? token_array.data[i + k].token_type : TOKEN_TYPE_EOF;
+    Token token = token_stream_next(&stream);
+    if (peeked->token_type != expected_type || token.token_type != token_array.data[i].token_type ||
+        token.source.index != token_array.data[i].source.index) {
+      printf("%s FAILED: token %zu differs from tokenise_input_file\n", test_name, i);
+      return false;
+    }
+  }
+
+  if (token_stream_next(&stream).token_type != TOKEN_TYPE_EOF) {
+    printf("%s FAILED: expected EOF at the end of the stream\n", test_name);
+    return false;
+  }
+  token_stream_end(&stream, stderr);
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_lazy_numbers(void) {
+  const char *test_name = "LAZY NUMBERS TEST";
+  const char *text = "42 -0.5 2.99792458e8 1.e3 7e information nan .";
+  char *input = sdm_pad_string(text, strlen(text));
+
+  Parser parser = {
+    .filename = "<numbers>",
+    .contents = sdm_cstr_as_sv(input),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+    .flags = LEX_LAZY_NUMBERS,
+  };
+
+  TokenArray token_array = {0};
+  tokenise_input_file(&parser, &token_array);
+
+  TokenType expected_types[] = {
+    TOKEN_TYPE_INT, TOKEN_TYPE_FLOAT, TOKEN_TYPE_FLOAT, TOKEN_TYPE_FLOAT,
+    TOKEN_TYPE_INT, TOKEN_TYPE_ID, TOKEN_TYPE_ID, TOKEN_TYPE_ID, TOKEN_TYPE_POINT,
+  };
+  uint32_t expected_lengths[] = { 2, 4, 12, 4, 1, 1, 11, 3, 1 };
+  if (token_array.length != SDM_ARRAY_LENGTH(expected_types)) {
+    printf("%s FAILED: expected %zu tokens but found %zu\n", test_name, SDM_ARRAY_LENGTH(expected_types), token_array.length);
+    return false;
+  }
+  for (size_t i=0; i<token_array.length; i++) {
+    if (token_array.data[i].token_type != expected_types[i] || token_array.data[i].length != expected_lengths[i]) {
+      printf("%s FAILED: token %zu has the wrong type or length\n", test_name, i);
+      return false;
+    }
+  }
+
+  Token *number = &token_array.data[2];
+  if (number->as.float_token.converted) {
+    printf("%s FAILED: a number was converted eagerly\n", test_name);
+    return false;
+  }
+  if (token_float_value(number) != 2.99792458e8 || !number->as.float_token.converted ||
+      token_int_value(&token_array.data[0]) != 42 || token_float_value(&token_array.data[1]) != -0.5) {
+    printf("%s FAILED: numbers were converted incorrectly\n", test_name);
+    return false;
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_string_escapes(void) {
+  const char *test_name = "STRING ESCAPES TEST";
+  const char *text = "\"plain\" \"say \\\"hi\\\"\\n\" \"back\\\\slash\" \"odd \\q\" x";
+  char *input = sdm_pad_string(text, strlen(text));
+
+  Parser parser = {
+    .filename = "<strings>",
+    .contents = sdm_cstr_as_sv(input),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+
+  TokenArray token_array = {0};
+  tokenise_input_file(&parser, &token_array);
+
+  const char *expected[] = { "plain", "say \"hi\"\n", "back\\slash", "odd \\q" };
+  if (token_array.length != SDM_ARRAY_LENGTH(expected) + 1) {
+    printf("%s FAILED: expected %zu tokens but found %zu\n", test_name, SDM_ARRAY_LENGTH(expected) + 1, token_array.length);
+    return false;
+  }
+  for (size_t i=0; i<SDM_ARRAY_LENGTH(expected); i++) {
+    Token token = token_array.data[i];
+    sdm_string_view value = token_string_value(&token);
+    if (token.token_type != TOKEN_TYPE_STRING || !sdm_sv_compare(value, sdm_cstr_as_sv((char*)expected[i]))) {
+      printf("%s FAILED: string %zu decoded to '"SDM_SV_F"'\n", test_name, i, SDM_SV_Vals(value));
+      return false;
+    }
+  }
+
+  // Strings without escapes are not copied
+  if (token_string_value(&token_array.data[0]).data != input + 1 || token_array.data[0].as.str_token.has_escapes) {
+    printf("%s FAILED: an escape-free string was copied\n", test_name);
+    return false;
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_diagnostics(void) {
+  const char *test_name = "DIAGNOSTICS TEST";
+  const char *expected_filename = "tests/diagnostics_expected.txt";
+  const char *actual_filename = "tests/diagnostics_actual.txt";
+  const char *text = "ok @@@@ ok\n`\x01\x01\n$ % & \"never closed";
+  char *input = sdm_pad_string(text, strlen(text));
+
+  FILE *output = fopen(actual_filename, "w");
+  if (output == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", actual_filename);
+    return false;
+  }
+
+  // Once with room for everything, and once with a cap that drops most of it
+  size_t caps[] = { 10, 2 };
+  for (size_t i=0; i<SDM_ARRAY_LENGTH(caps); i++) {
+    Diagnostics diagnostics = { .max_diagnostics = caps[i] };
+    Parser parser = {
+      .filename = "<diagnostics>",
+      .contents = sdm_cstr_as_sv(input),
+      .col = 1,
+      .line = 1,
+      .index = 0,
+      .diagnostics = &diagnostics,
+    };
+
+    TokenArray token_array = {0};
+    tokenise_input_file(&parser, &token_array);
+    report_diagnostics(&parser, &diagnostics, output);
+  }
+
+  // The parser reads through a token stream, which reports what the lexer found
+  // wrong along with its own errors
+  const char *program = "let s: int = \"never closed";
+  Parser parser = {
+    .filename = "<stream>",
+    .contents = sdm_cstr_as_sv(sdm_pad_string(program, strlen(program))),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+  Ast ast = { .errors = output };
+  parse_program(&parser, &ast);
+  if (parser.diagnostics != NULL) {
+    fclose(output);
+    printf("%s FAILED: the token stream left its diagnostics attached to the parser\n", test_name);
+    return false;
+  }
+
+  // Nesting and long chains are refused rather than overflowing the stack of the parser,
+  // or of whatever walks the tree later
+  static char deep[1024 * 1024];
+  const char *shapes[][3] = { { "(", "1.0", ")" }, { "-", "1.0", "" }, { "", "1.0", " + 1.0" } };
+  for (size_t i=0; i<SDM_ARRAY_LENGTH(shapes); i++) {
+    size_t length = snprintf(deep, sizeof(deep), "let x: float = ");
+    for (size_t n=0; n<100000; n++) length += snprintf(deep + length, sizeof(deep) - length, "%s", shapes[i][0]);
+    length += snprintf(deep + length, sizeof(deep) - length, "%s", shapes[i][1]);
+    for (size_t n=0; n<100000; n++) length += snprintf(deep + length, sizeof(deep) - length, "%s", shapes[i][2]);
+    length += snprintf(deep + length, sizeof(deep) - length, ";");
+    Parser deep_parser = {
+      .filename = "<deep>",
+      .contents = sdm_sized_str_as_sv(sdm_pad_string(deep, length), length),
+      .col = 1,
+      .line = 1,
+      .index = 0,
+    };
+    Ast deep_ast = { .errors = output };
+    if (parse_program(&deep_parser, &deep_ast)) {
+      fclose(output);
+      printf("%s FAILED: an expression nested 100000 deep was accepted\n", test_name);
+      return false;
+    }
+  }
+
+  fclose(output);
+
+  return compare_files(test_name, expected_filename, actual_filename);
+}
+
+bool test_float_format(void) {
+  const char *test_name = "FLOAT FORMAT TEST";
+  struct { double value; const char *text; } cases[] = {
+    { 2.99792458e8, "299792458.0" },
+    { 1.25,         "1.25" },
+    { -4.30427,     "-4.30427" },
+    { 0.1,          "0.1" },
+    { 1e-5,         "0.00001" },
+    { 0.0,          "0.0" },
+    { 1.0 / 3.0,    NULL },
+    { 1e22,         NULL },
+    { 5e-324,       NULL },
+    { 1.7976931348623157e308, NULL },
+  };
+
+  for (size_t i=0; i<SDM_ARRAY_LENGTH(cases); i++) {
+    char out[32] = {0};
+    size_t length = sdm_format_double(cases[i].value, out);
+    if (strtod(out, NULL) != cases[i].value || length != strlen(out) ||
+        (cases[i].text != NULL && strcmp(out, cases[i].text) != 0)) {
+      printf("%s FAILED: %.17g was written as '%s'\n", test_name, cases[i].value, out);
+      return false;
+    }
+  }
+
+  // Random bit patterns cover every exponent, subnormals included.  Each must read back
+  // exactly, and with one significant digit fewer nothing may.
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  for (size_t i=0; i<200000; i++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    double value;
+    memcpy(&value, &state, sizeof(value));
+    if (value != value || value - value != 0) continue;
+
+    char out[32] = {0};
+    size_t length = sdm_format_double(value, out);
+    size_t first = 0, last = 0, significant = 0;
+    for (size_t c=0; c<length && out[c] != 'e'; c++) {
+      if (out[c] < '1' || out[c] > '9') continue;
+      if (significant++ == 0) first = c;
+      last = c;
+    }
+    for (size_t c=first; c<=last; c++) significant += (out[c] == '0');
+    char shorter[320];
+    snprintf(shorter, sizeof(shorter), "%.*g", (int)significant - 1, value);
+    if (strtod(out, NULL) != value || length != strlen(out) || (significant > 1 && strtod(shorter, NULL) == value)) {
+      printf("%s FAILED: %.17g was written as '%s'\n", test_name, value, out);
+      return false;
+    }
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_ast(void) {
+  const char *test_name = "AST TEST";
+  const char *input_filename = "examples/example.txt";
+  const char *expected_filename = "tests/ast_expected.txt";
+  const char *actual_filename = "tests/ast_actual.txt";
+
+  char *buffer = sdm_read_entire_file(input_filename);
+
+  Parser parser = {
+    .filename = input_filename,
+    .contents = sdm_cstr_as_sv(buffer),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+
+  Ast ast = {0};
+  if (!parse_program(&parser, &ast)) {
+    printf("%s FAILED: Couldn't parse %s\n", test_name, input_filename);
+    return false;
+  }
+
+  FILE *output = fopen(actual_filename, "w");
+  if (output == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", actual_filename);
+    return false;
+  }
+
+  static sdm_writer writer;
+  sdm_writer_init(&writer, output);
+  dump_ast(&writer, &ast);
+  sdm_writer_flush(&writer);
+
+  fclose(output);
+
+  // Errors too long for ast_error's stack buffer are written whole, with their location
+  char long_name[1500];
+  memset(long_name, 'x', sizeof(long_name) - 1);
+  long_name[sizeof(long_name) - 1] = '\0';
+  char expected_error[sizeof(long_name) + 64];
+  snprintf(expected_error, sizeof(expected_error), "%s:1:1: ERROR: '%s' is not defined\n", input_filename, long_name);
+  char written_error[sizeof(expected_error)] = {0};
+  ast.errors = tmpfile();
+  if (ast.errors == NULL) {
+    fprintf(stderr, "Couldn't open a temporary file\n");
+    return false;
+  }
+  ast_error(&ast, 0, "'%s' is not defined", long_name);
+  rewind(ast.errors);
+  size_t written = fread(written_error, 1, sizeof(written_error) - 1, ast.errors);
+  fclose(ast.errors);
+  ast.errors = NULL;
+  if (written != strlen(expected_error) || strcmp(written_error, expected_error) != 0) {
+    printf("%s FAILED: a long error message was cut short\n", test_name);
+    return false;
+  }
+
+  return compare_files(test_name, expected_filename, actual_filename);
+}
+
+bool test_evaluator(void) {
+  const char *test_name = "EVALUATOR TEST";
+  const char *expected_filename = "tests/eval_errors_expected.txt";
+  const char *actual_filename = "tests/eval_errors_actual.txt";
+  const char *programs[] = {
+    "let h_rf: int = 176;\n"
+    "let c0: float = 2.99792458e8;\n"
+    "let periods: int = 20;\n"
+    "let circumference: float = 528.0/periods;\n"
+    "let frequency: float = c0/circumference*h_rf;\n"
+    "let thirds: int = periods / 3;\n"
+    "let folded: float = 2 * (1.5 + 0.5) - -1;\n"
+    "let early: float = later * 2;\n"
+    "let later: int = 7;\n"
+    "let a: int = b + 1;\n"
+    "let b: int = a;\n"
+    "let bad: int = 1.5;\n"
+    "let zero: int = periods / (h_rf - 176);\n",
+    "let x: int = y;\nlet x: int = 1;\n",
+  };
+
+  FILE *errors = fopen(actual_filename, "w");
+  if (errors == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", actual_filename);
+    return false;
+  }
+
+  Ast asts[SDM_ARRAY_LENGTH(programs)] = {0};
+  Evaluator evaluators[SDM_ARRAY_LENGTH(programs)];
+  bool initialised[SDM_ARRAY_LENGTH(programs)];
+  for (size_t i=0; i<SDM_ARRAY_LENGTH(programs); i++) {
+    char *input = sdm_pad_string(programs[i], strlen(programs[i]));
+    Parser parser = {
+      .filename = "<eval>",
+      .contents = sdm_cstr_as_sv(input),
+      .col = 1,
+      .line = 1,
+      .index = 0,
+    };
+    asts[i].errors = errors;
+    if (!parse_program(&parser, &asts[i])) {
+      fclose(errors);
+      printf("%s FAILED: Couldn't parse program %zu\n", test_name, i);
+      return false;
+    }
+    initialised[i] = evaluator_init(&evaluators[i], &asts[i]);
+  }
+
+  Evaluator *evaluator = &evaluators[0];
+  struct { const char *name; ValueKind kind; double value; } cases[] = {
+    { "h_rf",          VALUE_INT,   176 },
+    { "circumference", VALUE_FLOAT, 528.0 / 20 },
+    { "frequency",     VALUE_FLOAT, 2.99792458e8 / (528.0 / 20) * 176 },
+    { "thirds",        VALUE_INT,   6 },
+    { "folded",        VALUE_FLOAT, 5.0 },
+    { "early",         VALUE_FLOAT, 14.0 },
+    { "a",             VALUE_NONE,  0 },
+    { "b",             VALUE_NONE,  0 },
+    { "bad",           VALUE_NONE,  0 },
+    { "zero",          VALUE_NONE,  0 },
+  };
+
+  bool passed = initialised[0] && !initialised[1];
+  if (!passed) printf("%s FAILED: expected only the second program to be rejected\n", test_name);
+
+  for (size_t i=0; passed && i<SDM_ARRAY_LENGTH(cases); i++) {
+    uint32_t binding = evaluator_find(evaluator, sdm_cstr_as_sv((char*)cases[i].name));
+    Value value;
+    bool ok = binding != EVAL_NO_BINDING && evaluate_binding(evaluator, binding, &value);
+    if (cases[i].kind == VALUE_NONE) {
+      if (ok) {
+        printf("%s FAILED: expected '%s' not to evaluate\n", test_name, cases[i].name);
+        passed = false;
+      }
+    } else if (!ok || value.kind != cases[i].kind || value_as_float(value) != cases[i].value) {
+      printf("%s FAILED: wrong value for '%s'\n", test_name, cases[i].name);
+      passed = false;
+    }
+  }
+
+  // Literal-only subexpressions are folded when the evaluator is set up
+  uint32_t folded = evaluator_find(evaluator, sdm_cstr_as_sv("folded"));
+  if (passed && ast_node(&asts[0], evaluator->bindings.data[folded].value)->kind != AST_NODE_FLOAT) {
+    printf("%s FAILED: 'folded' was not folded to a literal\n", test_name);
+    passed = false;
+  }
+
+  // A second request is served from the memoised value
+  if (passed) {
+    Value value;
+    uint32_t frequency = evaluator_find(evaluator, sdm_cstr_as_sv("frequency"));
+    if (evaluator->bindings.data[frequency].state != BINDING_DONE || !evaluate_binding(evaluator, frequency, &value)) {
+      printf("%s FAILED: 'frequency' was not memoised\n", test_name);
+      passed = false;
+    }
+  }
+
+  // A long chain of bindings, asked for from the far end, mustn't need a stack frame per link
+  static char chain[4 * 1024 * 1024];
+  size_t links = 100000;
+  size_t length = snprintf(chain, sizeof(chain), "let x0: float = 1.0;\n");
+  for (size_t i=1; i<links; i++) {
+    length += snprintf(chain + length, sizeof(chain) - length, "let x%zu: float = x%zu + 1.0;\n", i, i - 1);
+  }
+  if (passed) {
+    char *input = sdm_pad_string(chain, length);
+    Parser parser = {
+      .filename = "<chain>",
+      .contents = sdm_cstr_as_sv(input),
+      .col = 1,
+      .line = 1,
+      .index = 0,
+    };
+    static Ast ast;
+    static Evaluator chained;
+    ast.errors = errors;
+    Value value;
+    bool ok = parse_program(&parser, &ast) && evaluator_init(&chained, &ast) &&
+      evaluate_binding(&chained, (uint32_t)links - 1, &value);
+    if (!ok || value.kind != VALUE_FLOAT || value.as.float_value != (double)links) {
+      printf("%s FAILED: wrong value at the end of a chain of %zu bindings\n", test_name, links);
+      passed = false;
+    }
+  }
+
+  fclose(errors);
+  if (!passed) return false;
+
+  return compare_files(test_name, expected_filename, actual_filename);
+}
+
+bool test_vm(void) {
+  const char *test_name = "VM TEST";
+  const char *expected_filename = "tests/vm_expected.txt";
+  const char *actual_filename = "tests/vm_actual.txt";
+  const char *program =
+    "let periods: int = 20;\n"
+    "let circumference: float = 528.0/periods;\n"
+    "let name: int = 7;\n"
+    "println(\"Circumference = \", circumference, \" m\");\n"
+    "println(periods / 3, \" \", periods * -(1.5 + circumference) / 2, \" \", -periods);\n"
+    "let shown: int = println(\"evaluated once\") ;\n"
+    "println();\n"
+    "println(periods / (name - 7));\n"
+    "println(\"never reached\");\n";
+  char *input = sdm_pad_string(program, strlen(program));
+
+  FILE *output = fopen(actual_filename, "w");
+  if (output == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", actual_filename);
+    return false;
+  }
+
+  Parser parser = {
+    .filename = "<vm>",
+    .contents = sdm_cstr_as_sv(input),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+  Ast ast = { .errors = output };
+  static Evaluator evaluator;
+  static Vm vm;
+  if (!parse_program(&parser, &ast) || !evaluator_init(&evaluator, &ast)) {
+    fclose(output);
+    printf("%s FAILED: Couldn't load the program\n", test_name);
+    return false;
+  }
+  vm_init(&vm, &evaluator);
+  vm.output = output;
+
+  bool compiled = vm_compile(&vm);
+  bool ran = compiled && vm_run(&vm);
+
+  // A call in a let binding goes through the same builtins
+  Value value;
+  bool called = evaluate_binding(&evaluator, evaluator_find(&evaluator, sdm_cstr_as_sv("shown")), &value);
+
+  fclose(output);
+
+  if (!compiled || ran || called) {
+    printf("%s FAILED: expected the program to compile, then stop at the division by zero\n", test_name);
+    return false;
+  }
+
+  return compare_files(test_name, expected_filename, actual_filename);
+}
+
+bool test_invalidation(void) {
+  const char *test_name = "INVALIDATION TEST";
+  const char *program =
+    "let h_rf: int = 176;\n"
+    "let c0: float = 2.99792458e8;\n"
+    "let circumference: float = 528.0/20;\n"
+    "let frequency: float = c0/circumference*h_rf;\n"
+    "let unrelated: float = c0 * 2;\n"
+    "let total: float = frequency * 2 + frequency;\n";
+  char *input = sdm_pad_string(program, strlen(program));
+
+  Parser parser = {
+    .filename = "<invalidation>",
+    .contents = sdm_cstr_as_sv(input),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+  Ast ast = {0};
+  static Evaluator evaluator;
+  if (!parse_program(&parser, &ast) || !evaluator_init(&evaluator, &ast)) {
+    printf("%s FAILED: Couldn't load the program\n", test_name);
+    return false;
+  }
+
+  uint32_t h_rf = evaluator_find(&evaluator, sdm_cstr_as_sv("h_rf"));
+  uint32_t frequency = evaluator_find(&evaluator, sdm_cstr_as_sv("frequency"));
+  uint32_t unrelated = evaluator_find(&evaluator, sdm_cstr_as_sv("unrelated"));
+  uint32_t total = evaluator_find(&evaluator, sdm_cstr_as_sv("total"));
+
+  // total names frequency twice but depends on it once
+  uint32_t count;
+  const uint32_t *dependents = evaluator_dependents(&evaluator, frequency, &count);
+  if (count != 1 || dependents[0] != total) {
+    printf("%s FAILED: expected total to be the only dependent of frequency\n", test_name);
+    return false;
+  }
+
+  Value value;
+  for (uint32_t b=0; b<evaluator.bindings.length; b++) {
+    if (!evaluate_binding(&evaluator, b, &value)) {
+      printf("%s FAILED: couldn't evaluate binding %u\n", test_name, b);
+      return false;
+    }
+  }
+
+  Value tuned = { .kind = VALUE_INT, .as.int_value = 100 };
+  if (!evaluator_override(&evaluator, h_rf, tuned)) {
+    printf("%s FAILED: couldn't override h_rf\n", test_name);
+    return false;
+  }
+  if (evaluator.bindings.data[frequency].state != BINDING_UNEVALUATED ||
+      evaluator.bindings.data[total].state != BINDING_UNEVALUATED ||
+      evaluator.bindings.data[unrelated].state != BINDING_DONE) {
+    printf("%s FAILED: the override invalidated the wrong bindings\n", test_name);
+    return false;
+  }
+
+  double expected = 3 * (2.99792458e8 / (528.0 / 20) * 100);
+  if (!evaluate_binding(&evaluator, total, &value) || value.as.float_value != expected) {
+    printf("%s FAILED: total was not recomputed from the new h_rf\n", test_name);
+    return false;
+  }
+
+  // Dropping the override brings back the value from the source
+  evaluator_invalidate(&evaluator, h_rf);
+  expected = 3 * (2.99792458e8 / (528.0 / 20) * 176);
+  if (!evaluate_binding(&evaluator, total, &value) || value.as.float_value != expected) {
+    printf("%s FAILED: total was not restored after invalidating h_rf\n", test_name);
+    return false;
+  }
+
+  // A float can't stand in for an int
+  Value wrong = { .kind = VALUE_FLOAT, .as.float_value = 1.5 };
+  ast.errors = fopen("/dev/null", "w");
+  bool accepted = evaluator_override(&evaluator, h_rf, wrong);
+  fclose(ast.errors);
+  if (accepted) {
+    printf("%s FAILED: a float override of an int was accepted\n", test_name);
+    return false;
+  }
+
+  printf("%s PASSED\n", test_name);
+  return true;
+}
+
+bool test_parallel_eval(void) {
+  const char *test_name = "PARALLEL EVALUATION TEST";
+  const char *expected_filename = "tests/parallel_expected.txt";
+  const char *actual_filename = "tests/parallel_actual.txt";
+
+  // Many independent bindings, a layer that mixes them, a long chain, a binding with
+  // side effects (and one depending on it), and a cycle
+  static char program[256 * 1024];
+  size_t length = 0;
+  size_t count = 1000;
+  length += snprintf(program + length, sizeof(program) - length, "let base: float = 1.5;\nlet k0: int = 3;\n");
+  for (size_t i=0; i<count; i++) {
+    length += snprintf(program + length, sizeof(program) - length, "let x%zu: float = base * %zu + k0;\n", i, i);
+  }
+  for (size_t i=0; i<count; i++) {
+    length += snprintf(program + length, sizeof(program) - length, "let y%zu: float = x%zu * x%zu - base / x%zu;\n", i, i, (i * 7) % count, (i * 13) % count);
+  }
+  length += snprintf(program + length, sizeof(program) - length, "let chain0: float = y0;\n");
+  for (size_t i=1; i<200; i++) {
+    length += snprintf(program + length, sizeof(program) - length, "let chain%zu: float = chain%zu + y%zu;\n", i, i - 1, i);
+  }
+  length += snprintf(program + length, sizeof(program) - length,
+                     "let shown: int = println(\"in order\");\n"
+                     "let after: int = shown + 1;\n"
+                     "let loop_a: int = loop_b;\n"
+                     "let loop_b: int = loop_a + k0;\n");
+  char *input = sdm_pad_string(program, length);
+
+  FILE *output = fopen(actual_filename, "w");
+  if (output == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", actual_filename);
+    return false;
+  }
+
+  // The same program, evaluated on one thread and on four
+  size_t thread_counts[] = { 1, 4 };
+  Ast asts[2] = {0};
+  static Evaluator evaluators[2];
+  static Vm vms[2];
+  for (size_t i=0; i<2; i++) {
+    Parser parser = {
+      .filename = "<parallel>",
+      .contents = sdm_sized_str_as_sv(input, length),
+      .col = 1,
+      .line = 1,
+      .index = 0,
+    };
+    asts[i].errors = output;
+    if (!parse_program(&parser, &asts[i]) || !evaluator_init(&evaluators[i], &asts[i])) {
+      fclose(output);
+      printf("%s FAILED: Couldn't load the program\n", test_name);
+      return false;
+    }
+    vm_init(&vms[i], &evaluators[i]);
+    vms[i].output = output;
+    if (evaluate_all(&evaluators[i], thread_counts[i])) {
+      fclose(output);
+      printf("%s FAILED: expected the cycle to be reported\n", test_name);
+      return false;
+    }
+  }
+  fclose(output);
+
+  const BindingArray *sequential = &evaluators[0].bindings;
+  const BindingArray *parallel = &evaluators[1].bindings;
+  for (size_t b=0; b<sequential->length; b++) {
+    const Binding *expected = &sequential->data[b];
+    const Binding *actual = &parallel->data[b];
+    bool same = expected->state == actual->state && expected->result.kind == actual->result.kind &&
+                (expected->result.kind != VALUE_FLOAT || expected->result.as.float_value == actual->result.as.float_value) &&
+                (expected->result.kind != VALUE_INT || expected->result.as.int_value == actual->result.as.int_value);
+    if (!same) {
+      printf("%s FAILED: binding '%s' differs between 1 and 4 threads\n", test_name, symbol_name(expected->symbol).data);
+      return false;
+    }
+  }
+  for (size_t i=0; i<2; i++) evaluator_free(&evaluators[i]);
+
+  return compare_files(test_name, expected_filename, actual_filename);
+}
+
+bool test_jobs_output(void) {
+  const char *test_name = "JOBS OUTPUT TEST";
+  const char *expected_filename = "tests/jobs_expected.txt";
+  const char *actual_filename = "tests/jobs_actual.txt";
+  // Bindings the program never uses aren't evaluated, and errors come when a value is
+  // first used, whether or not a pool evaluated it ahead of time
+  const char *programs[] = {
+    "let a: int = 1; println(\"first\"); let s: int = println(\"side\"); println(\"last\", a);\n",
+    "let z: int = 1;\n"
+    "let bad: int = 1 / (z - 1);\n"
+    "let uses: int = bad + 1;\n"
+    "let typed: int = 1.5 * z;\n"
+    "let chain: float = typed + 1.0;\n"
+    "println(\"before\");\n"
+    "println(chain);\n"
+    "println(uses);\n",
+  };
+  size_t jobs[] = { 0, 2, 4 };
+
+  char *first_output = NULL;
+  bool first_ran[SDM_ARRAY_LENGTH(programs)];
+  for (size_t j=0; j<SDM_ARRAY_LENGTH(jobs); j++) {
+    FILE *output = fopen(actual_filename, "w");
+    if (output == NULL) {
+      fprintf(stderr, "Couldn't open %s\n", actual_filename);
+      return false;
+    }
+
+    bool ran[SDM_ARRAY_LENGTH(programs)];
+    for (size_t i=0; i<SDM_ARRAY_LENGTH(programs); i++) {
+      Parser parser = {
+        .filename = "<jobs>",
+        .contents = sdm_cstr_as_sv(sdm_pad_string(programs[i], strlen(programs[i]))),
+        .col = 1,
+        .line = 1,
+        .index = 0,
+      };
+      Ast ast = { .errors = output };
+      static Evaluator evaluator;
+      static Vm vm;
+      if (!parse_program(&parser, &ast) || !evaluator_init(&evaluator, &ast)) {
+        fclose(output);
+        printf("%s FAILED: Couldn't load program %zu\n", test_name, i);
+        return false;
+      }
+      vm_init(&vm, &evaluator);
+      vm.output = output;
+      if (jobs[j] > 0) evaluate_reachable(&evaluator, jobs[j]);
+      ran[i] = vm_compile(&vm) && vm_run(&vm);
+      evaluator_free(&evaluator);
+    }
+    fclose(output);
+
+    if (j == 0) {
+      first_output = sdm_read_entire_file(actual_filename);
+      memcpy(first_ran, ran, sizeof(ran));
+    } else if (strcmp(first_output, sdm_read_entire_file(actual_filename)) != 0 ||
+               memcmp(first_ran, ran, sizeof(ran)) != 0) {
+      printf("%s FAILED: the output with %zu jobs differs from the output without\n", test_name, jobs[j]);
+      return false;
+    }
+  }
+
+  return compare_files(test_name, expected_filename, actual_filename);
+}
+
+bool test_lines(void) {
+  const char *test_name = "LINES TEST";
+  const char *expected_filename = "tests/lines_expected.txt";
+  const char *actual_filename = "tests/lines_actual.txt";
+  const char *programs[] = {
+    "let a: Drift = Drift(L = 1.5);\n"
+    "let q: Quad = Quad(L = 0.25, K1 = -4.0);\n"
+    "let x: Line = Line(a, q);\n"
+    "let y: Line = Line(a, q);\n"
+    "let z: Line = Line(-x, 3 * -(2 * y), q);\n"
+    "let outer: Line = Line(z, -z);\n"
+    "let not_number: Quad = Quad(L = x);\n"
+    "let holds_number: Line = Line(a, 1.5);\n"
+    "let backwards: Line = Line(x * 2);\n"
+    "let mistyped: Quad = Drift(L = 1.0);\n"
+    "let longer: Drift = Drift(L = 2.5);\n"
+    "let wide: Line = Line(a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q);\n"
+    "let wide_bad: Line = Line(a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, a, q, 1.5);\n",
+    NULL,  // examples/example.txt, evaluated on four threads
+  };
+
+  FILE *errors = fopen(actual_filename, "w");
+  if (errors == NULL) {
+    fprintf(stderr, "Couldn't open %s\n", actual_filename);
+    return false;
+  }
+
+  Ast asts[SDM_ARRAY_LENGTH(programs)] = {0};
+  static Evaluator evaluators[SDM_ARRAY_LENGTH(programs)];
+  static Lattice lattices[SDM_ARRAY_LENGTH(programs)];
+  static Vm vms[SDM_ARRAY_LENGTH(programs)];
+  for (size_t i=0; i<SDM_ARRAY_LENGTH(programs); i++) {
+    const char *filename = programs[i] != NULL ? "<lines>" : "examples/example.txt";
+    char *input = programs[i] != NULL ? sdm_pad_string(programs[i], strlen(programs[i])) : sdm_read_entire_file(filename);
+    Parser parser = {
+      .filename = filename,
+      .contents = sdm_cstr_as_sv(input),
+      .col = 1,
+      .line = 1,
+      .index = 0,
+    };
+    asts[i].errors = errors;
+    if (!parse_program(&parser, &asts[i]) || !evaluator_init(&evaluators[i], &asts[i]) ||
+        !lattice_init(&lattices[i], &evaluators[i])) {
+      fclose(errors);
+      printf("%s FAILED: Couldn't load program %zu\n", test_name, i);
+      return false;
+    }
+    vm_init(&vms[i], &evaluators[i]);
+    vms[i].lattice = &lattices[i];
+    evaluate_all(&evaluators[i], programs[i] != NULL ? 1 : 4);
+  }
+
+  // Element arguments are bound to parameters before anything is evaluated
+  const char *bad_arguments = "let positional: Drift = Drift(1.0);\n"
+                              "let twice: Drift = Drift(L = 1.0, L = 2.0);\n"
+                              "let unknown: Drift = Drift(L = 1.0, K1 = 2.0);\n"
+                              "let misspelt: Quad = Quad(L = 1.0, Kl = 2.0);\n";
+  Parser parser = {
+    .filename = "<arguments>",
+    .contents = sdm_cstr_as_sv(sdm_pad_string(bad_arguments, strlen(bad_arguments))),
+    .col = 1,
+    .line = 1,
+    .index = 0,
+  };
+  Ast bad_ast = { .errors = errors };
+  static Evaluator bad_evaluator;
+  static Lattice bad_lattice;
+  if (!parse_program(&parser, &bad_ast) || !evaluator_init(&bad_evaluator, &bad_ast) ||
+      lattice_init(&bad_lattice, &bad_evaluator)) {
+    fclose(errors);
+    printf("%s FAILED: expected the bad arguments to be rejected\n", test_name);
+    return false;
+  }
+  lattice_free(&bad_lattice);
+  fclose(errors);
+
+  Value values[6];
+  const char *names[] = { "a", "x", "y", "z", "outer", "q" };
+  for (size_t i=0; i<SDM_ARRAY_LENGTH(names); i++) {
+    uint32_t binding = evaluator_find(&evaluators[0], sdm_cstr_as_sv((char*)names[i]));
+    if (binding == EVAL_NO_BINDING || !evaluate_binding(&evaluators[0], binding, &values[i])) {
+      printf("%s FAILED: '%s' didn't evaluate\n", test_name, names[i]);
+      return false;
+    }
+  }
+
+  const Lattice *lattice = &lattices[0];
+  // Each kind of element has its own table, with a row per constructor call
+  uint32_t a = values[0].as.handle, q = values[5].as.handle;
+  if (values[0].kind != VALUE_ELEMENT || VALUE_HANDLE_KIND(a) != KEYWORD_DRIFT || lattice->drifts.L[VALUE_HANDLE_INDEX(a)] != 1.5 ||
+      VALUE_HANDLE_KIND(q) != KEYWORD_QUAD || VALUE_HANDLE_INDEX(q) != 0 || lattice->element_counts[KEYWORD_QUAD] != 2 ||
+      lattice->quads.K1[0] != -4.0 || lattice->quads.Phi[0] != 0.0) {
+    printf("%s FAILED: 'a' and 'q' weren't stored as expected\n", test_name);
+    return false;
+  }
+
+  // Lines with the same items share them
+  const Line *x = lattice_line(lattice, values[1].as.handle);
+  const Line *y = lattice_line(lattice, values[2].as.handle);
+  if (values[1].as.handle == values[2].as.handle || x->items != y->items || x->item_count != 2 || x->depth != 1) {
+    printf("%s FAILED: 'x' and 'y' don't share their items\n", test_name);
+    return false;
+  }
+
+  // Reversal and repetition are kept on the items rather than expanded
+  const Line *z = lattice_line(lattice, values[3].as.handle);
+  LineItem expected_z[] = {
+    { .target = values[1].as.handle, .repeat = 1, .flags = LINE_ITEM_REVERSED },
+    { .target = values[2].as.handle, .repeat = 6, .flags = LINE_ITEM_REVERSED },
+    { .target = values[5].as.handle, .repeat = 1, .flags = 0 },
+  };
+  if (z->item_count != 3 || memcmp(z->items, expected_z, sizeof(expected_z)) != 0 || z->depth != 2 ||
+      lattice_line(lattice, values[4].as.handle)->depth != 3) {
+    printf("%s FAILED: 'z' doesn't have the expected items\n", test_name);
+    return false;
+  }
+
+  // Reversal leaves the sums alone and repetition multiplies them
+  LineSums sums = lattice_sums(&lattices[0], values[4].as.handle);
+  if (sums.element_count != 30 || sums.length != 25.0 || sums.k1l != -16.0 || !z->summed) {
+    printf("%s FAILED: wrong sums for 'outer'\n", test_name);
+    return false;
+  }
+
+  // Walking -z visits z's elements backwards, each one turned around
+  uint32_t walked[64], reversed_z[64], block[4];
+  bool orientation[64], reversed_orientation[64], block_orientation[4];
+  uint32_t count = 0, reversed_count = 0, n;
+  LineIterator iterator;
+  line_iterator_init(&iterator, lattice, values[3].as.handle, false);
+  while (count < 64 && line_iterator_next(&iterator, &walked[count], &orientation[count])) count++;
+  line_iterator_init(&iterator, lattice, values[3].as.handle, true);
+  while ((n = line_iterator_next_block(&iterator, block, block_orientation, 4)) > 0 && reversed_count + n <= 64) {
+    memcpy(&reversed_z[reversed_count], block, n * sizeof(uint32_t));
+    memcpy(&reversed_orientation[reversed_count], block_orientation, n * sizeof(bool));
+    reversed_count += n;
+  }
+  bool walked_ok = count == 15 && reversed_count == 15 && walked[0] == values[5].as.handle && orientation[0] &&
+                   walked[14] == values[5].as.handle && !orientation[14];
+  for (uint32_t i=0; walked_ok && i<count; i++) {
+    walked_ok = reversed_z[i] == walked[count - 1 - i] && reversed_orientation[i] != orientation[count - 1 - i];
+  }
+  if (!walked_ok) {
+    printf("%s FAILED: walking 'z' didn't give the expected elements\n", test_name);
+    return false;
+  }
+
+  // Changing an element rebuilds the lines that hold it, and with them their sums
+  Value longer;
+  uint32_t outer = evaluator_find(&evaluators[0], sdm_cstr_as_sv("outer"));
+  if (!evaluate_binding(&evaluators[0], evaluator_find(&evaluators[0], sdm_cstr_as_sv("longer")), &longer) ||
+      !evaluator_override(&evaluators[0], evaluator_find(&evaluators[0], sdm_cstr_as_sv("a")), longer) ||
+      !evaluate_binding(&evaluators[0], outer, &values[4]) ||
+      lattice_sums(&lattices[0], values[4].as.handle).length != 39.0) {
+    printf("%s FAILED: the sums for 'outer' weren't brought up to date\n", test_name);
+    return false;
+  }
+
+  // A line with more items than fit on the stack while it is put together
+  Value wide;
+  if (!evaluate_binding(&evaluators[0], evaluator_find(&evaluators[0], sdm_cstr_as_sv("wide")), &wide) ||
+      lattice_line(&lattices[0], wide.as.handle)->item_count != 40 ||
+      lattice_line(&lattices[0], wide.as.handle)->items[39].target != q) {
+    printf("%s FAILED: 'wide' doesn't have the expected items\n", test_name);
+    return false;
+  }
+
+  // The example, built on several threads, comes out as it is written
+  const Evaluator *evaluator = &evaluators[1];
+  lattice = &lattices[1];
+  const Line *sp = lattice_line(lattice, evaluator->bindings.data[evaluator_find(evaluator, sdm_cstr_as_sv("sp"))].result.as.handle);
+  const Line *sup_per = lattice_line(lattice, evaluator->bindings.data[evaluator_find(evaluator, sdm_cstr_as_sv("sup_per"))].result.as.handle);
+  const Line *unit_cell = lattice_line(lattice, evaluator->bindings.data[evaluator_find(evaluator, sdm_cstr_as_sv("unit_cell"))].result.as.handle);
+  uint32_t m_cell = evaluator->bindings.data[evaluator_find(evaluator, sdm_cstr_as_sv("m_cell"))].result.as.handle;
+  uint32_t d_corr = evaluator->bindings.data[evaluator_find(evaluator, sdm_cstr_as_sv("d_corr"))].result.as.handle;
+  const Value *line_length = &evaluator->bindings.data[evaluator_find(evaluator, sdm_cstr_as_sv("line_length"))].result;
+  if (sp->depth != 5 || sup_per->item_count != 8 ||
+      line_length->kind != VALUE_FLOAT || line_length->as.float_value < 26.4 - 1e-9 || line_length->as.float_value > 26.4 + 1e-9 ||
+      sup_per->items[0].target != m_cell || sup_per->items[0].flags != LINE_ITEM_REVERSED ||
+      unit_cell->item_count != 13 || unit_cell->items[7].target != d_corr || unit_cell->items[7].repeat != 2) {
+    printf("%s FAILED: the example's lines don't have the expected structure\n", test_name);
+    return false;
+  }
+
+  // get_length_of_line has no side effects, so line_length was left to the pool
+  if (evaluator->bindings.data[evaluator_find(evaluator, sdm_cstr_as_sv("line_length"))].sequential) {
+    printf("%s FAILED: 'line_length' wasn't evaluated on the pool\n", test_name);
+    return false;
+  }
+
+  uint64_t visited = 0;
+  uint32_t element;
+  line_iterator_init(&iterator, lattice, evaluator->bindings.data[evaluator_find(evaluator, sdm_cstr_as_sv("sp"))].result.as.handle, false);
+  while (line_iterator_next(&iterator, &element, NULL)) visited++;
+  if (visited != sp->sums.element_count || !sp->summed) {
+    printf("%s FAILED: walked %zu elements of 'sp' rather than %zu\n", test_name, (size_t)visited, (size_t)sp->sums.element_count);
+    return false;
+  }
+
+  for (size_t i=0; i<SDM_ARRAY_LENGTH(programs); i++) {
+    lattice_free(&lattices[i]);
+    evaluator_free(&evaluators[i]);
+  }
+
+  return compare_files(test_name, expected_filename, actual_filename);
+}
+
 bool compare_files(const char *testname, const char *filename1, const char *filename2) {
   bool comparison_result = true;
   char *expected_buff = sdm_read_entire_file(filename1);
@@ -1,19 +1,84 @@
-#include <ctype.h>
-#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <threads.h>
 
 #include "token_lib.h"
 #include "sdm_lib.h"
 
+// Every identifier the lexer sees is interned here, so a name is only stored once
+// and later stages can compare identifiers by symbol id.  Nothing guards it; lexers
+// running on other threads intern through Parser.symbols instead.
+static sdm_interner symbol_table = {0};
+
+uint32_t intern_symbol(sdm_string_view name, uint64_t hash) {
+  return sdm_intern(&symbol_table, name, hash);
+}
+
+bool find_symbol(sdm_string_view name, uint32_t *symbol) {
+  return sdm_interner_find(&symbol_table, name, sdm_sv_hash(name), symbol);
+}
+
+sdm_string_view symbol_name(uint32_t symbol) {
+  return sdm_interned_name(&symbol_table, symbol);
+}
+
+size_t symbol_count(void) {
+  return symbol_table.names.length;
+}
+
+void reset_symbol_table(void) {
+  // The table lives in the active allocator, so this must be called if that is reset
+  memset(&symbol_table, 0, sizeof(symbol_table));
+}
+
+typedef struct {
+  const char *text;
+  size_t length;
+  KeywordKind kind;
+} KeywordEntry;
+
+static const KeywordEntry keyword_table[KEYWORD_TABLE_SIZE] = {
+#define X(name, text, first, last) \
+  [KEYWORD_HASH(sizeof(text) - 1, first, last)] = { text, sizeof(text) - 1, KEYWORD_##name },
+  KEYWORD_LIST(X)
+#undef X
+};
+
+static const char *keyword_names[KEYWORD_COUNT] = {
+  [KEYWORD_NONE] = "",
+#define X(name, text, first, last) [KEYWORD_##name] = text,
+  KEYWORD_LIST(X)
+#undef X
+};
+
+KeywordKind lookup_keyword(const char *text, size_t length) {
+  if (length == 0) return KEYWORD_NONE;
+  const KeywordEntry *entry = &keyword_table[KEYWORD_HASH(length, text[0], text[length - 1])];
+  if (entry->length != length || memcmp(entry->text, text, length) != 0) return KEYWORD_NONE;
+  return entry->kind;
+}
+
+const char *keyword_name(KeywordKind kind) {
+  return keyword_names[kind];
+}
+
 char *get_current_parser_string(Parser parser) {
   return parser.contents.data + parser.index;
 }
 
-void advance_to_next_line(Parser *parser) {
-  while (parser->contents.data[parser->index] != '\n') {
-    parser->index++;
+size_t skip_until(const char *data, size_t index, size_t length, char stop) {
+  // Relies on the NUL sentinel at data[length]: the length is only checked when a NUL is
+  // found, so that NULs embedded in the input are skipped over like any other byte
+  for (;;) {
+    while (data[index] != stop && data[index] != '\0') index++;
+    if (data[index] == stop || index >= length) return index;
+    index++;
   }
+}
+
+void advance_to_next_line(Parser *parser) {
+  parser->index = skip_until(parser->contents.data, parser->index, parser->contents.length, '\n');
+  if (parser->index >= parser->contents.length) return;
   parser->index++;
   if (parser->index < parser->contents.length) {
     parser->line++;
@@ -22,18 +87,97 @@ void advance_to_next_line(Parser *parser) {
 }
 
 bool starts_with_comment(Parser parser) {
-  const char *comment_marker = "//";
-  return strncmp(get_current_parser_string(parser), comment_marker, strlen(comment_marker)) == 0;
+  // Safe at the end of the input thanks to the padding
+  const char *text = get_current_parser_string(parser);
+  return text[0] == '/' && text[1] == '/';
+}
+
+size_t scan_number(const char *text, bool *is_float) {
+  // [+-]? (digits ('.' digits*)? | '.' digits) ([eE] [+-]? digits)?
+  // Returns 0 if text doesn't start with a number.  This is the decimal subset of what strtod
+  // accepts, so names like "inf" or "nan_offset" stay identifiers.
+  size_t i = 0;
+  size_t digits = 0;
+  *is_float = false;
+
+  if (text[i] == '+' || text[i] == '-') i++;
+  while (sdm_is_digit(text[i])) { i++; digits++; }
+  if (text[i] == '.') {
+    i++;
+    *is_float = true;
+    while (sdm_is_digit(text[i])) { i++; digits++; }
+  }
+  if (digits == 0) return 0;
+
+  if (text[i] == 'e' || text[i] == 'E') {
+    size_t exponent = i + 1;
+    if (text[exponent] == '+' || text[exponent] == '-') exponent++;
+    if (sdm_is_digit(text[exponent])) {
+      while (sdm_is_digit(text[exponent])) exponent++;
+      i = exponent;
+      *is_float = true;
+    }
+  }
+
+  return i;
 }
 
 size_t starts_with_float(Parser parser) {
-  char *endptr;
-  char *input = get_current_parser_string(parser);
-  errno = 0;
-  strtod(input, &endptr);
-  if (errno != 0) return 0;
-  size_t retval = endptr - input;
-  return retval;
+  bool is_float;
+  return scan_number(get_current_parser_string(parser), &is_float);
+}
+
+double token_float_value(Token *token) {
+  if (!token->as.float_token.converted) {
+    // The text is a complete decimal literal, so strtod stops exactly at its end
+    token->as.float_token.value = strtod(token->source.contents.data + token->source.index, NULL);
+    token->as.float_token.converted = true;
+  }
+  return token->as.float_token.value;
+}
+
+size_t token_string_decode(const Token *token, char *buffer) {
+  // buffer needs room for token->as.str_token.length bytes; the result is never longer
+  const char *raw = token->as.str_token.raw;
+  size_t length = token->as.str_token.length;
+  size_t out = 0;
+  for (size_t i=0; i<length; i++) {
+    if (raw[i] != '\\' || i + 1 == length) {
+      buffer[out++] = raw[i];
+      continue;
+    }
+    switch (raw[++i]) {
+      case 'n':  buffer[out++] = '\n'; break;
+      case 't':  buffer[out++] = '\t'; break;
+      case 'r':  buffer[out++] = '\r'; break;
+      case '0':  buffer[out++] = '\0'; break;
+      case '"':  buffer[out++] = '"';  break;
+      case '\\': buffer[out++] = '\\'; break;
+      default:
+        // Unknown escapes are kept as written
+        buffer[out++] = '\\';
+        buffer[out++] = raw[i];
+    }
+  }
+  return out;
+}
+
+sdm_string_view token_string_value(const Token *token) {
+  if (!token->as.str_token.has_escapes) {
+    return sdm_sized_str_as_sv((char*)token->as.str_token.raw, token->as.str_token.length);
+  }
+  char *buffer = SDM_MALLOC(token->as.str_token.length + 1);
+  size_t length = token_string_decode(token, buffer);
+  buffer[length] = '\0';
+  return sdm_sized_str_as_sv(buffer, length);
+}
+
+int64_t token_int_value(Token *token) {
+  if (!token->as.int_token.converted) {
+    token->as.int_token.value = strtoll(token->source.contents.data + token->source.index, NULL, 10);
+    token->as.int_token.converted = true;
+  }
+  return token->as.int_token.value;
 }
 
 char parser_current_char(const Parser *parser) {
@@ -41,14 +185,78 @@ char parser_current_char(const Parser *parser) {
 }
 
 bool parser_isalpha(const Parser *parser) {
-  return isalpha(parser_current_char(parser));
+  return sdm_is_id_start(parser_current_char(parser));
 }
 
 bool parser_is_id_char(const Parser *parser) {
-  return 
-    parser_isalpha(parser) || 
-    parser_current_char(parser) == '_' || 
-    isalnum(parser_current_char(parser));
+  return sdm_is_id_char(parser_current_char(parser));
+}
+
+void add_diagnostic(Parser *parser, DiagnosticKind kind, size_t offset, size_t end, const char *payload, size_t payload_len) {
+  Diagnostics *diagnostics = parser->diagnostics;
+  if (diagnostics == NULL) return;
+
+  if (diagnostics->length > 0) {
+    Diagnostic *last = &diagnostics->data[diagnostics->length - 1];
+    if (last->kind == kind && last->end == offset) {
+      last->count++;
+      last->end = end;
+      return;
+    }
+  }
+
+  size_t max_diagnostics = diagnostics->max_diagnostics ? diagnostics->max_diagnostics : DEFAULT_MAX_DIAGNOSTICS;
+  if (diagnostics->length >= max_diagnostics) {
+    diagnostics->dropped++;
+    return;
+  }
+
+  Diagnostic diagnostic = {
+    .kind = kind,
+    .count = 1,
+    .offset = offset,
+    .end = end,
+  };
+  if (payload != NULL) memcpy(diagnostic.payload, payload, payload_len < sizeof(diagnostic.payload) ? payload_len : sizeof(diagnostic.payload));
+  SDM_ARRAY_PUSH(*diagnostics, diagnostic);
+}
+
+void report_diagnostics(const Parser *parser, const Diagnostics *diagnostics, FILE *stream) {
+  // Lines and columns are worked out here, in one pass over the input, rather than while lexing
+  const char *data = parser->contents.data;
+  size_t line = 1;
+  size_t line_start = 0;
+  size_t scanned = 0;
+
+  for (size_t i=0; i<diagnostics->length; i++) {
+    const Diagnostic *diagnostic = &diagnostics->data[i];
+    for (; scanned < diagnostic->offset; scanned++) {
+      if (data[scanned] == '\n') {
+        line++;
+        line_start = scanned + 1;
+      }
+    }
+    fprintf(stream, "%s:%zu:%zu: WARNING: ", parser->filename, line, diagnostic->offset - line_start + 1);
+
+    switch (diagnostic->kind) {
+      case DIAGNOSTIC_UNKNOWN_CHAR: {
+        unsigned char c = diagnostic->payload[0];
+        if (diagnostic->count > 1) fprintf(stream, "Unsure how to parse %u bytes in a row, starting with ", diagnostic->count);
+        else fprintf(stream, "Unsure how to parse ");
+        if (c >= 0x20 && c < 0x7f) fprintf(stream, "'%c'", c);
+        else fprintf(stream, "byte 0x%02x", c);
+      } break;
+      case DIAGNOSTIC_UNTERMINATED_STRING:
+        fprintf(stream, "Unterminated string");
+        break;
+    }
+
+    fprintf(stream, "\n");
+  }
+
+  if (diagnostics->dropped > 0) {
+    fprintf(stream, "%s: WARNING: %zu further diagnostics were not shown\n", parser->filename, diagnostics->dropped);
+  }
 }
 
 Token get_next_token(Parser *parser) {
@@ -60,31 +268,47 @@ Token get_next_token(Parser *parser) {
   };
 
   Token token = {0};
-  memcpy(&token.source, parser, sizeof(*parser));
+  token.source = (TokenSource){
+    .filename = parser->filename,
+    .contents = parser->contents,
+    .line = parser->line,
+    .col = parser->col,
+    .index = parser->index,
+  };
   size_t len; // Only valid for the float/int part of the code
+  bool is_float;
 
   if (parser->index >= parser->contents.length) {
     token.token_type = TOKEN_TYPE_EOF;
-  } else if ((len = starts_with_float(*parser)) > 0) {
-    // Could be an integer or a float
-    char *start_ptr = parser->contents.data + parser->index;
-    char *end_ptr = start_ptr;
-    strtol(start_ptr, &end_ptr, 10);
-    if ((end_ptr - start_ptr) == (long)len) {
-      token.token_type = TOKEN_TYPE_INT;
-      token.as.int_token.value = atoi(start_ptr);
-    } else {
-      token.token_type = TOKEN_TYPE_FLOAT;
-      token.as.float_token.value = atof(start_ptr);
-    }
+  } else if ((len = scan_number(get_current_parser_string(*parser), &is_float)) > 0) {
     parser->index += len;
+    token.length = len;
+    token.token_type = is_float ? TOKEN_TYPE_FLOAT : TOKEN_TYPE_INT;
+    if (!(parser->flags & LEX_LAZY_NUMBERS)) {
+      if (is_float) token_float_value(&token);
+      else token_int_value(&token);
+    }
   } else if (parser_isalpha(parser)) {
     size_t start_index = parser->index;
-    while (parser_is_id_char(parser)) parser->index++;
+    parser->index = sdm_skip_id_chars(parser->contents.data, start_index + 1);
     size_t len = parser->index - start_index;
-    token.token_type = TOKEN_TYPE_ID;
-    token.as.id_token.value = SDM_MALLOC((len+1) * sizeof(char));
-    memcpy(token.as.id_token.value, &parser->contents.data[start_index], len);
+    KeywordKind keyword = lookup_keyword(&parser->contents.data[start_index], len);
+    if (keyword != KEYWORD_NONE) {
+      token.token_type = TOKEN_TYPE_KEYWORD;
+      token.as.keyword_token.kind = keyword;
+    } else {
+      sdm_string_view name = sdm_sized_str_as_sv(&parser->contents.data[start_index], len);
+      // The name was just scanned, so hashing it word-at-a-time reads from L1
+      uint64_t hash = sdm_hash_bytes(name.data, name.length);
+      token.token_type = TOKEN_TYPE_ID;
+      if (parser->symbols != NULL) {
+        token.as.id_token.symbol = sdm_concurrent_intern(parser->symbols, name, hash, start_index);
+      } else {
+        uint32_t symbol = intern_symbol(name, hash);
+        token.as.id_token.symbol = symbol;
+        token.as.id_token.value = symbol_name(symbol).data;
+      }
+    }
   } else if (parser_current_char(parser) == ',') {
     token.token_type = TOKEN_TYPE_COMMA;
     parser->index += 1;
@@ -122,35 +346,404 @@ Token get_next_token(Parser *parser) {
     // We have a string.  We have to find the end
     parser->index++;
     size_t str_start = parser->index;
-    while ((parser->index < parser->contents.length) && (parser_current_char(parser) != '"')) {
-      parser->index++;
+    const char *data = parser->contents.data;
+    size_t index = str_start;
+    bool has_escapes = false;
+    for (;;) {
+      while (data[index] != '"' && data[index] != '\\' && data[index] != '\0') index++;
+      if (data[index] == '"') break;
+      if (data[index] == '\0') {
+        if (index >= parser->contents.length) break;
+        index++;
+      } else {
+        // Skip the escaped character, unless the backslash is the last byte of the input
+        has_escapes = true;
+        index += (index + 1 < parser->contents.length) ? 2 : 1;
+      }
     }
-    size_t str_len = parser->index - str_start;
+    parser->index = index;
     token.token_type = TOKEN_TYPE_STRING;
-    token.as.str_token.value = SDM_MALLOC(str_len + 1);
-    memset(token.as.str_token.value, 0, str_len + 1);
-    memcpy(token.as.str_token.value, parser->contents.data+str_start, str_len);
-    parser->index += str_len + 1;
+    token.as.str_token.raw = data + str_start;
+    token.as.str_token.length = index - str_start;
+    token.as.str_token.has_escapes = has_escapes;
+    if (parser->index < parser->contents.length) {
+      parser->index++;  // The closing quote
+    } else {
+      add_diagnostic(parser, DIAGNOSTIC_UNTERMINATED_STRING, token.source.index, parser->index, NULL, 0);
+    }
   } else {
-    fprintf(stderr, "WARNING: Unsure how to parse '%c'\n", parser->contents.data[parser->index]);
+    add_diagnostic(parser, DIAGNOSTIC_UNKNOWN_CHAR, parser->index, parser->index + 1, &parser->contents.data[parser->index], 1);
     token.token_type = TOKEN_TYPE_UNKNOWN;
     parser->index += 1;
   }
 
+  token.length = parser->index - token.source.index;
+
   return token;
 }
 
+size_t estimate_token_count(sdm_string_view contents) {
+  // Counts the places a token could start: every byte that is neither whitespace nor part
+  // of an identifier or number that has already started.  That includes bytes the lexer
+  // doesn't know (control bytes, DEL, anything >= 0x80), each of which becomes a token of
+  // its own.  This over-counts numbers like 1.5e3 and words in comments, which is fine as
+  // the array is only sized from it.  Needs a padded buffer.
+  const char *data = contents.data;
+  size_t count = 1;  // EOF
+  unsigned prev_id = 0;
+  for (size_t i=0; i<contents.length; i+=SDM_CLASSIFY_BLOCK) {
+    sdm_char_masks masks = sdm_classify_block(data + i);
+    unsigned valid_mask = (contents.length - i >= SDM_CLASSIFY_BLOCK) ? (1u << SDM_CLASSIFY_BLOCK) - 1 : (1u << (contents.length - i)) - 1;
+    unsigned other_mask = ~masks.space & ~masks.id;
+    unsigned id_starts  = masks.id & ~((masks.id << 1) | prev_id);
+    count += __builtin_popcount((other_mask | id_starts) & valid_mask);
+    prev_id = (masks.id >> (SDM_CLASSIFY_BLOCK - 1)) & 1;
+  }
+  return count;
+}
+
+// Used by the tokenise_* functions and token streams when the caller hasn't supplied a
+// Diagnostics, so that they still report their problems (once, at the end).  The buffer is the
+// caller's, on its stack, rather than a static one.
+static bool begin_default_diagnostics(Parser *parser, Diagnostics *diagnostics) {
+  if (parser->diagnostics != NULL) return false;
+  memset(diagnostics, 0, sizeof(*diagnostics));
+  parser->diagnostics = diagnostics;
+  return true;
+}
+
+static void end_default_diagnostics(Parser *parser, Diagnostics *diagnostics, FILE *output) {
+  report_diagnostics(parser, diagnostics, output);
+  parser->diagnostics = NULL;
+}
+
 void tokenise_input_file(Parser *parser, TokenArray *token_array) {
   sdm_string_view contents = parser->contents;
 
+  // Allocate the array once at (about) its final size; pushes still grow it if this is short
+  size_t estimate = estimate_token_count(sdm_sized_str_as_sv(contents.data + parser->index,
+                                                             contents.length - parser->index));
+  SDM_ENSURE_ARRAY_MIN_CAP(*token_array, token_array->length + estimate);
+
+  Diagnostics diagnostics;
+  bool report_at_end = begin_default_diagnostics(parser, &diagnostics);
   while (parser->index < contents.length) {
     SDM_ARRAY_PUSH(*token_array, get_next_token(parser));
   }
+  if (report_at_end) end_default_diagnostics(parser, &diagnostics, stderr);
+}
+
+void token_list_push(TokenList *list, Token token) {
+  if ((list->length & (TOKEN_BLOCK_SIZE - 1)) == 0 && (list->length >> TOKEN_BLOCK_SHIFT) == list->blocks.length) {
+    Token *block = SDM_MALLOC(TOKEN_BLOCK_SIZE * sizeof(Token));
+    if (block == NULL) {
+      fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+      exit(1);
+    }
+    SDM_ARRAY_PUSH(list->blocks, block);
+  }
+  *token_list_at(list, list->length) = token;
+  list->length++;
+}
+
+void tokenise_input_file_segmented(Parser *parser, TokenList *token_list) {
+  sdm_string_view contents = parser->contents;
+
+  Diagnostics diagnostics;
+  bool report_at_end = begin_default_diagnostics(parser, &diagnostics);
+  while (parser->index < contents.length) {
+    token_list_push(token_list, get_next_token(parser));
+  }
+  if (report_at_end) end_default_diagnostics(parser, &diagnostics, stderr);
+}
+
+// tokenise_input_file_parallel cuts the input into pieces that start at the beginning of a
+// line and lexes each on its own thread.  A piece's first tokens are wrong if a token (a
+// string running over a line break, say) spans the cut, so each piece also lexes the one
+// token past its end, and the merge lexes on from there on the calling thread until it
+// reaches a token the next piece has at the same place and column.  Usually that is the
+// next piece's first token.
+#define LEX_MIN_PIECE_BYTES (16 * 1024)
+
+typedef struct {
+  Parser parser;        // Where the piece starts; where its lexer stopped once it has run
+  size_t end;           // Tokens starting at or after this belong to the next piece
+  TokenArray tokens;
+  Diagnostics diagnostics;
+  Token next;           // The first token past end, if the input goes on
+  bool has_next;
+  sdm_arena_t arena;
+} LexPiece;
+
+// Lexing a token and then deciding it belongs to someone else means taking back whatever
+// it added to the diagnostics, which may have been merged into the last entry
+typedef struct {
+  size_t length;
+  size_t dropped;
+  Diagnostic last;
+} DiagnosticsMark;
+
+static DiagnosticsMark mark_diagnostics(const Diagnostics *diagnostics) {
+  DiagnosticsMark mark = { .length = diagnostics->length, .dropped = diagnostics->dropped };
+  if (mark.length > 0) mark.last = diagnostics->data[mark.length - 1];
+  return mark;
+}
+
+static void restore_diagnostics(Diagnostics *diagnostics, const DiagnosticsMark *mark) {
+  diagnostics->length = mark->length;
+  diagnostics->dropped = mark->dropped;
+  if (mark->length > 0) diagnostics->data[mark->length - 1] = mark->last;
+}
+
+static int lex_piece(void *arg) {
+  LexPiece *piece = arg;
+  Parser *parser = &piece->parser;
+  sdm_arena_t *previous = active_swap_arena(&piece->arena);
+
+  parser->diagnostics = &piece->diagnostics;
+  while (parser->index < parser->contents.length) {
+    DiagnosticsMark mark = mark_diagnostics(&piece->diagnostics);
+    Token token = get_next_token(parser);
+    if (token.source.index >= piece->end && piece->end < parser->contents.length) {
+      restore_diagnostics(&piece->diagnostics, &mark);
+      piece->next = token;
+      piece->has_next = true;
+      break;
+    }
+    SDM_ARRAY_PUSH(piece->tokens, token);
+  }
+
+  active_swap_arena(previous);
+  return 0;
+}
+
+static void merge_diagnostic(Diagnostics *diagnostics, const Diagnostic *diagnostic) {
+  // The same merging and capping add_diagnostic does, applied to an entry that may
+  // already stand for several occurrences
+  if (diagnostics->length > 0) {
+    Diagnostic *last = &diagnostics->data[diagnostics->length - 1];
+    if (last->kind == diagnostic->kind && last->end == diagnostic->offset) {
+      last->count += diagnostic->count;
+      last->end = diagnostic->end;
+      return;
+    }
+  }
+
+  size_t max_diagnostics = diagnostics->max_diagnostics ? diagnostics->max_diagnostics : DEFAULT_MAX_DIAGNOSTICS;
+  if (diagnostics->length >= max_diagnostics) {
+    diagnostics->dropped += diagnostic->count;
+    return;
+  }
+  SDM_ARRAY_PUSH(*diagnostics, *diagnostic);
+}
+
+void tokenise_input_file_parallel(Parser *parser, TokenArray *token_array, size_t thread_count) {
+  sdm_string_view contents = parser->contents;
+  size_t start = parser->index;
+  size_t remaining = contents.length - start;
+  if (thread_count > remaining / LEX_MIN_PIECE_BYTES) thread_count = remaining / LEX_MIN_PIECE_BYTES;
+  if (thread_count <= 1) {
+    tokenise_input_file(parser, token_array);
+    return;
+  }
+
+  // Two identifiers are always separated by at least one byte, so this many names is plenty
+  sdm_concurrent_interner symbols;
+  sdm_concurrent_interner_init(&symbols, remaining / 2 + 1);
+
+  LexPiece *pieces = SDM_MALLOC(thread_count * sizeof(LexPiece));
+  thrd_t *threads = SDM_MALLOC(thread_count * sizeof(thrd_t));
+  bool *started = SDM_MALLOC(thread_count * sizeof(bool));
+  if (pieces == NULL || threads == NULL || started == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+  memset(pieces, 0, thread_count * sizeof(LexPiece));
+
+  size_t begin = start;
+  for (size_t i=0; i<thread_count; i++) {
+    size_t end = contents.length;
+    if (i + 1 < thread_count) {
+      end = skip_until(contents.data, start + remaining * (i + 1) / thread_count, contents.length, '\n');
+      if (end < contents.length) end++;
+      if (end < begin) end = begin;
+    }
+    LexPiece *piece = &pieces[i];
+    piece->parser = *parser;
+    piece->parser.index = begin;
+    piece->parser.symbols = &symbols;
+    if (i > 0) {
+      // Only the line and column relative to the start of the piece are known; the merge
+      // shifts the lines once it knows where the piece really starts
+      piece->parser.line = 1;
+      piece->parser.col = 1;
+    }
+    piece->end = end;
+    piece->diagnostics.max_diagnostics = SIZE_MAX;
+    begin = end;
+  }
+
+  // The calling thread lexes the first piece
+  for (size_t i=1; i<thread_count; i++) {
+    started[i] = thrd_create(&threads[i], lex_piece, &pieces[i]) == thrd_success;
+  }
+  lex_piece(&pieces[0]);
+  for (size_t i=1; i<thread_count; i++) {
+    if (started[i]) thrd_join(threads[i], NULL);
+    else lex_piece(&pieces[i]);
+  }
+
+  Diagnostics diagnostics;
+  bool report_at_end = begin_default_diagnostics(parser, &diagnostics);
+  size_t first_token = token_array->length;
+  size_t token_count = 0;
+  for (size_t i=0; i<thread_count; i++) token_count += pieces[i].tokens.length;
+  SDM_ENSURE_ARRAY_MIN_CAP(*token_array, token_array->length + token_count);
+
+  const LexPiece *last_piece = NULL;
+  size_t line_shift = 0;
+  for (size_t i=0; i<thread_count; i++) {
+    LexPiece *piece = &pieces[i];
+    size_t first = 0;
+    size_t resume_at = 0;  // The piece's diagnostics before this are for tokens it doesn't keep
+    if (i > 0) {
+      if (!last_piece->has_next) break;
+
+      // Lex on from the last piece's stopping point, straight into the results, until
+      // reaching a token this piece has too.  The column must match as well, as it is
+      // only reset at a line break.
+      Parser lexer = piece->parser;
+      lexer.index = last_piece->next.source.index;
+      lexer.line = last_piece->next.source.line + line_shift;
+      lexer.col = last_piece->next.source.col;
+      lexer.diagnostics = parser->diagnostics;
+      for (;;) {
+        DiagnosticsMark mark = mark_diagnostics(parser->diagnostics);
+        Token token = get_next_token(&lexer);
+        while (first < piece->tokens.length && piece->tokens.data[first].source.index < token.source.index) first++;
+        if (first < piece->tokens.length && piece->tokens.data[first].source.index == token.source.index &&
+            piece->tokens.data[first].source.col == token.source.col) {
+          restore_diagnostics(parser->diagnostics, &mark);
+          line_shift = token.source.line - piece->tokens.data[first].source.line;
+          resume_at = token.source.index;
+          break;
+        }
+        bool past_end = token.source.index >= piece->end && piece->end < contents.length;
+        if (past_end) {
+          // The whole piece was inside one token
+          restore_diagnostics(parser->diagnostics, &mark);
+          piece->next = token;
+        } else {
+          SDM_ARRAY_PUSH(*token_array, token);
+        }
+        if (past_end || lexer.index >= contents.length) {
+          piece->has_next = past_end;
+          piece->parser = lexer;
+          first = piece->tokens.length;
+          line_shift = 0;
+          resume_at = SIZE_MAX;
+          break;
+        }
+      }
+    }
+
+    for (size_t t=first; t<piece->tokens.length; t++) {
+      Token token = piece->tokens.data[t];
+      token.source.line += line_shift;
+      SDM_ARRAY_PUSH(*token_array, token);
+    }
+    for (size_t d=0; d<piece->diagnostics.length; d++) {
+      if (piece->diagnostics.data[d].offset >= resume_at) merge_diagnostic(parser->diagnostics, &piece->diagnostics.data[d]);
+    }
+    last_piece = piece;
+  }
+  parser->index = last_piece->parser.index;
+  parser->line = last_piece->parser.line + line_shift;
+  parser->col = last_piece->parser.col;
+
+  // Give the names their ids in the shared table in the order the tokens use them, which is
+  // the order the sequential lexer would have interned them in.  Unlike
+  // sdm_concurrent_interner_canonicalise, this leaves out names only seen in tokens that
+  // were thrown away at a cut.
+  uint32_t provisional_count = atomic_load(&symbols.next_id);
+  uint32_t *remap = SDM_MALLOC(provisional_count * sizeof(uint32_t));
+  if (provisional_count > 0 && remap == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+  memset(remap, 0xff, provisional_count * sizeof(uint32_t));
+  for (size_t t=first_token; t<token_array->length; t++) {
+    Token *token = &token_array->data[t];
+    if (token->token_type != TOKEN_TYPE_ID) continue;
+    uint32_t *symbol = &remap[token->as.id_token.symbol];
+    if (*symbol == UINT32_MAX) {
+      const sdm_concurrent_entry *entry = &symbols.entries[token->as.id_token.symbol];
+      *symbol = intern_symbol(entry->name, entry->hash);
+    }
+    token->as.id_token.symbol = *symbol;
+    token->as.id_token.value = symbol_name(*symbol).data;
+  }
+
+  for (size_t i=0; i<thread_count; i++) sdm_arena_free(&pieces[i].arena);
+  if (report_at_end) end_default_diagnostics(parser, &diagnostics, stderr);
+}
+
+void token_stream_init(TokenStream *stream, Parser *parser) {
+  memset(stream, 0, sizeof(*stream));
+  stream->parser = parser;
+  stream->owns_diagnostics = begin_default_diagnostics(parser, &stream->diagnostics);
+}
+
+void token_stream_end(TokenStream *stream, FILE *output) {
+  if (stream->owns_diagnostics) end_default_diagnostics(stream->parser, &stream->diagnostics, output);
+  stream->owns_diagnostics = false;
+}
+
+const Token *token_stream_peek(TokenStream *stream, size_t k) {
+  if (k >= TOKEN_STREAM_LOOKAHEAD) {
+    fprintf(stderr, "Can't peek %zu tokens ahead (the limit is %d).\n", k, TOKEN_STREAM_LOOKAHEAD);
+    exit(1);
+  }
+  while (stream->count <= k) {
+    size_t slot = (stream->head + stream->count) & (TOKEN_STREAM_LOOKAHEAD - 1);
+    stream->ring[slot] = get_next_token(stream->parser);
+    stream->count++;
+  }
+  return &stream->ring[(stream->head + k) & (TOKEN_STREAM_LOOKAHEAD - 1)];
+}
+
+Token token_stream_next(TokenStream *stream) {
+  Token token = *token_stream_peek(stream, 0);
+  stream->head = (stream->head + 1) & (TOKEN_STREAM_LOOKAHEAD - 1);
+  stream->count--;
+  return token;
+}
+
+void dump_token(sdm_writer *writer, Token *token) {
+  // One line per token: "<type> :: <value>", where only literals, identifiers and keywords have a value
+  sdm_write_int(writer, token->token_type);
+  sdm_write_bytes(writer, " :: ", 4);
+  switch (token->token_type) {
+    case TOKEN_TYPE_STRING:  sdm_write_sv(writer, token_string_value(token)); break;
+    case TOKEN_TYPE_INT:     sdm_write_int(writer, token_int_value(token)); break;
+    case TOKEN_TYPE_FLOAT:   sdm_write_double(writer, token_float_value(token)); break;
+    case TOKEN_TYPE_ID:      sdm_write_cstr(writer, token->as.id_token.value); break;
+    case TOKEN_TYPE_KEYWORD: sdm_write_cstr(writer, keyword_name(token->as.keyword_token.kind)); break;
+    default: break;
+  }
+  sdm_write_bytes(writer, "\n", 1);
+}
+
+void dump_tokens(sdm_writer *writer, TokenArray *token_array) {
+  for (size_t i=0; i<token_array->length; i++) {
+    dump_token(writer, &token_array->data[i]);
+  }
 }
 
 void parser_trim(Parser *parser) {
+  // The terminating NUL is not a space, so this stops at the end of the input
   char *text = get_current_parser_string(*parser);
-  while (strlen(text) > 0 && isspace(*text)) {
+  while (sdm_is_space(*text)) {
     if (*text == '\n') {
       parser->line++;
       parser->col = 1;
@@ -158,7 +751,7 @@ void parser_trim(Parser *parser) {
       parser->col++;
     }
     parser->index++;
-    text = get_current_parser_string(*parser);
+    text++;
   }
 }
 
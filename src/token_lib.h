@@ -1,20 +1,68 @@
 #ifndef _LL_LIB_H
 #define _LL_LIB_H
 
+#include "element_schema.h"
 #include "sdm_lib.h"
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #define SDM_ARRAY_LENGTH(array) sizeof((array)) / sizeof((array[0]))
 
+// Problems found while lexing are collected here rather than printed as they are
+// found, and reported together by report_diagnostics().  Consecutive occurrences
+// of the same problem are merged into one entry, and once max_diagnostics
+// entries are stored any further ones are only counted.
+typedef enum {
+  DIAGNOSTIC_UNKNOWN_CHAR,
+  DIAGNOSTIC_UNTERMINATED_STRING,
+} DiagnosticKind;
+
+typedef struct {
+  DiagnosticKind kind;
+  uint32_t count;
+  size_t offset;
+  size_t end;
+  char payload[8];
+} Diagnostic;
+
+#define DEFAULT_MAX_DIAGNOSTICS 100
+
+typedef struct {
+  size_t capacity;
+  size_t length;
+  Diagnostic *data;
+  size_t max_diagnostics;  // DEFAULT_MAX_DIAGNOSTICS if zero
+  size_t dropped;
+} Diagnostics;
+
+// Lexer options, set in Parser.flags
+#define LEX_LAZY_NUMBERS 0x1  // Leave numeric literals unconverted until token_*_value() is called
+
 typedef struct {
   const char *filename;
   sdm_string_view contents;
   size_t line;
   size_t col;
   size_t index;
+  uint32_t flags;
+  Diagnostics *diagnostics;  // If NULL, get_next_token discards its diagnostics
+  // If set, identifiers are interned here instead of in the symbol table, so that several
+  // threads can lex at once.  Their symbols are then provisional and their values NULL
+  // until tokenise_input_file_parallel() renumbers them.
+  sdm_concurrent_interner *symbols;
 } Parser;
 
+// Where a token came from: the parser's position when the token started, without
+// the lexer's options and buffers
+typedef struct {
+  const char *filename;
+  sdm_string_view contents;
+  size_t line;
+  size_t col;
+  size_t index;
+} TokenSource;
+
 // typedef struct {
 //   char *filename;
 //   sdm_string_view contents;
@@ -50,20 +98,52 @@ typedef enum {
   TOKEN_TYPE_COUNT,
 } TokenType;
 
-typedef struct { char *value; } IDToken;
-typedef struct { double value; } FloatToken;
-typedef struct { int64_t value; } IntToken;
-typedef struct { char *value; } StringToken;
+// Keywords and built-in type names.  Each entry gives the spelling along with its
+// first and last characters, which (with the length) select its slot in the
+// lexer's perfect-hash table.  Adding an entry that collides with an existing one
+// is caught at compile time by -Woverride-init (part of -Wextra).  The element kinds'
+// names come from their schema in element_schema.h.
+#define KEYWORD_LIST(X)                     \
+  X(LET,       "let",       'l', 't')       \
+  X(INT,       "int",       'i', 't')       \
+  X(FLOAT,     "float",     'f', 't')       \
+  X(LINE,      "Line",      'L', 'e')       \
+  ELEMENT_KEYWORDS(X)
+
+typedef enum {
+  KEYWORD_NONE = 0,
+#define X(name, text, first, last) KEYWORD_##name,
+  KEYWORD_LIST(X)
+#undef X
+  KEYWORD_COUNT,
+} KeywordKind;
+
+#define KEYWORD_TABLE_SIZE 16
+#define KEYWORD_HASH(length, first, last) \
+  (((length) + (unsigned char)(first) + (unsigned char)(last)) & (KEYWORD_TABLE_SIZE - 1))
+
+typedef struct { KeywordKind kind; } KeywordToken;
+// `value` points at the interned spelling, shared by every occurrence of the name
+typedef struct { char *value; uint32_t symbol; } IDToken;
+// In LEX_LAZY_NUMBERS mode `converted` is false until the value is first asked for
+typedef struct { double value; bool converted; } FloatToken;
+typedef struct { int64_t value; bool converted; } IntToken;
+// The raw text between the quotes, pointing into the input.  Escape sequences are
+// left as they are; use token_string_value() or token_string_decode() to get the
+// actual contents, which only copies when has_escapes is set.
+typedef struct { const char *raw; uint32_t length; bool has_escapes; } StringToken;
 
 typedef struct {
   TokenType token_type;
+  uint32_t length;  // Length of the token's text, which starts at source.index
   union {
     IDToken id_token;
+    KeywordToken keyword_token;
     FloatToken float_token;
     IntToken int_token;
     StringToken str_token;
   } as;
-  Parser source;
+  TokenSource source;
 } Token;
 
 typedef struct {
@@ -72,12 +152,92 @@ typedef struct {
   Token *data;
 } TokenArray;
 
+// A token list made of fixed-size blocks.  Appending never moves a token that is
+// already stored, so pointers into the list stay valid; only the table of block
+// pointers is ever reallocated.  Token i lives at blocks[i / size][i % size].
+#define TOKEN_BLOCK_SHIFT 12
+#define TOKEN_BLOCK_SIZE (1u << TOKEN_BLOCK_SHIFT)
+
+typedef struct {
+  size_t capacity;
+  size_t length;
+  Token **data;
+} TokenBlockTable;
+
+typedef struct {
+  TokenBlockTable blocks;
+  size_t length;
+} TokenList;
+
+typedef struct {
+  const TokenList *list;
+  size_t index;
+} TokenListIterator;
+
+static inline Token *token_list_at(const TokenList *list, size_t index) {
+  return &list->blocks.data[index >> TOKEN_BLOCK_SHIFT][index & (TOKEN_BLOCK_SIZE - 1)];
+}
+
+static inline TokenListIterator token_list_iter(const TokenList *list) {
+  return (TokenListIterator){ .list = list, .index = 0 };
+}
+
+// Returns NULL once every token has been visited
+static inline Token *token_list_next(TokenListIterator *iter) {
+  if (iter->index >= iter->list->length) return NULL;
+  return token_list_at(iter->list, iter->index++);
+}
+
+void token_list_push(TokenList *list, Token token);
+
+// Pulls tokens from the lexer on demand, buffering just enough for peek(k) in a
+// small ring.  A parser consuming from this only ever has a handful of tokens
+// live.  Once the input is exhausted every further token is TOKEN_TYPE_EOF.
+#define TOKEN_STREAM_LOOKAHEAD 8
+
+typedef struct {
+  Parser *parser;
+  Diagnostics diagnostics;  // Used if the parser doesn't come with its own
+  bool owns_diagnostics;
+  Token ring[TOKEN_STREAM_LOOKAHEAD];
+  size_t head;
+  size_t count;
+} TokenStream;
+
+void token_stream_init(TokenStream *stream, Parser *parser);
+const Token *token_stream_peek(TokenStream *stream, size_t k);
+Token token_stream_next(TokenStream *stream);
+// Reports to output whatever the lexer found wrong, if the stream collected it, and
+// detaches the stream from the parser
+void token_stream_end(TokenStream *stream, FILE *output);
+
 bool starts_with_comment(Parser parser);
 size_t starts_with_float(Parser parser);
+double token_float_value(Token *token);
+int64_t token_int_value(Token *token);
+size_t token_string_decode(const Token *token, char *buffer);
+sdm_string_view token_string_value(const Token *token);
 Token get_next_token(Parser *parser);
+size_t estimate_token_count(sdm_string_view contents);
 void tokenise_input_file(Parser *parser, TokenArray *token_array);
+void tokenise_input_file_segmented(Parser *parser, TokenList *token_list);
+void tokenise_input_file_parallel(Parser *parser, TokenArray *token_array, size_t thread_count);
 void parser_trim(Parser *parser);
+void dump_token(sdm_writer *writer, Token *token);
+void dump_tokens(sdm_writer *writer, TokenArray *token_array);
+void report_diagnostics(const Parser *parser, const Diagnostics *diagnostics, FILE *stream);
 void parser_chop(Parser *parser, size_t len);
 
+KeywordKind lookup_keyword(const char *text, size_t length);
+const char *keyword_name(KeywordKind kind);
+
+// The symbol table is shared by everything in the process and isn't synchronised, so
+// these must only be called from one thread at a time
+uint32_t intern_symbol(sdm_string_view name, uint64_t hash);
+bool find_symbol(sdm_string_view name, uint32_t *symbol);
+sdm_string_view symbol_name(uint32_t symbol);
+size_t symbol_count(void);
+void reset_symbol_table(void);
+
 #endif // !_LL_LIB_H
 
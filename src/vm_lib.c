@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vm_lib.h"
+#include "ast_lib.h"
+#include "eval_lib.h"
+#include "sdm_lib.h"
+#include "token_lib.h"
+
+// Computed-goto dispatch jumps straight from one handler to the next instead of back
+// through a switch.  It is a GNU extension, so other compilers get the switch.
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO
+#endif
+
+static const char *builtin_println(Vm *vm, const Value *args, uint32_t count, Value *result) {
+  FILE *output = vm->output != NULL ? vm->output : stdout;
+  for (uint32_t i=0; i<count; i++) {
+    char digits[32];
+    switch (args[i].kind) {
+      case VALUE_INT:
+        fwrite(digits, 1, sdm_format_int(args[i].as.int_value, digits), output);
+        break;
+      case VALUE_FLOAT:
+        fwrite(digits, 1, sdm_format_double(args[i].as.float_value, digits), output);
+        break;
+      case VALUE_STRING:
+        fwrite(args[i].as.string_value.data, 1, args[i].as.string_value.length, output);
+        break;
+      case VALUE_ELEMENT:
+      case VALUE_LINE:
+        fprintf(output, "<%s>", keyword_name(VALUE_HANDLE_KIND(args[i].as.handle)));
+        break;
+      case VALUE_NONE:
+        break;
+    }
+  }
+  fputc('\n', output);
+  result->kind = VALUE_NONE;
+  return NULL;
+}
+
+static const char *line_sums(Vm *vm, Value value, LineSums *sums) {
+  if (value.kind != VALUE_LINE && value.kind != VALUE_ELEMENT) return "Expected a line or an element";
+  if (vm->lattice == NULL) return "There are no lines to look at";
+  *sums = lattice_sums(vm->lattice, value.as.handle);
+  return NULL;
+}
+
+static const char *builtin_get_length_of_line(Vm *vm, const Value *args, uint32_t count, Value *result) {
+  (void)count;
+  LineSums sums;
+  const char *error = line_sums(vm, args[0], &sums);
+  if (error != NULL) return error;
+  result->kind = VALUE_FLOAT;
+  result->as.float_value = sums.length;
+  return NULL;
+}
+
+static const char *builtin_get_element_count(Vm *vm, const Value *args, uint32_t count, Value *result) {
+  (void)count;
+  LineSums sums;
+  const char *error = line_sums(vm, args[0], &sums);
+  if (error != NULL) return error;
+  result->kind = VALUE_INT;
+  result->as.int_value = (int64_t)sums.element_count;
+  return NULL;
+}
+
+static const char *builtin_get_bend_angle(Vm *vm, const Value *args, uint32_t count, Value *result) {
+  (void)count;
+  LineSums sums;
+  const char *error = line_sums(vm, args[0], &sums);
+  if (error != NULL) return error;
+  result->kind = VALUE_FLOAT;
+  result->as.float_value = sums.angle;
+  return NULL;
+}
+
+static const Builtin builtins[] = {
+  { "println",            0, EVAL_MAX_CALL_ARGS, builtin_println,            false },
+  { "get_length_of_line", 1, 1,                  builtin_get_length_of_line, true },
+  { "get_element_count",  1, 1,                  builtin_get_element_count,  true },
+  { "get_bend_angle",     1, 1,                  builtin_get_bend_angle,     true },
+};
+
+#define BUILTIN_COUNT SDM_ARRAY_LENGTH(builtins)
+#define NO_BUILTIN UINT32_MAX
+
+static uint32_t find_builtin(const Vm *vm, uint32_t symbol) {
+  // The table is short, and this is only used when compiling or from the evaluator
+  for (uint32_t i=0; i<BUILTIN_COUNT; i++) {
+    if (vm->builtin_symbols[i] == symbol) return i;
+  }
+  return NO_BUILTIN;
+}
+
+static bool check_arity(const Ast *ast, const AstNode *call, const Builtin *builtin, uint32_t count) {
+  if (count >= builtin->min_args && count <= builtin->max_args) return true;
+  if (builtin->min_args == builtin->max_args) {
+    ast_error(ast, call->offset, "%s takes %u arguments but was given %u", builtin->name, builtin->min_args, count);
+  } else {
+    ast_error(ast, call->offset, "%s takes %u to %u arguments but was given %u", builtin->name, builtin->min_args, builtin->max_args, count);
+  }
+  return false;
+}
+
+static bool call_from_evaluator(void *context, const AstNode *call, const Value *args, uint32_t count, Value *result) {
+  Vm *vm = context;
+  const Ast *ast = vm->evaluator->ast;
+  uint32_t index = find_builtin(vm, call->lhs);
+  if (index == NO_BUILTIN) {
+    ast_error(ast, call->offset, "Unknown function '%s'", symbol_name(call->lhs).data);
+    return false;
+  }
+  if (!check_arity(ast, call, &builtins[index], count)) return false;
+  const char *error = builtins[index].function(vm, args, count, result);
+  if (error != NULL) {
+    ast_error(ast, call->offset, "%s", error);
+    return false;
+  }
+  return true;
+}
+
+static bool call_is_pure(void *context, const AstNode *call) {
+  // Unknown functions count as impure, so that their errors come out in source order
+  uint32_t index = find_builtin(context, call->lhs);
+  return index != NO_BUILTIN && builtins[index].pure;
+}
+
+void vm_init(Vm *vm, Evaluator *evaluator) {
+  memset(vm, 0, sizeof(*vm));
+  vm->evaluator = evaluator;
+  evaluator->call = call_from_evaluator;
+  evaluator->call_context = vm;
+  evaluator->call_is_pure = call_is_pure;
+
+  // Builtins are matched by symbol id, so their names are interned once here
+  vm->builtin_symbols = SDM_MALLOC(BUILTIN_COUNT * sizeof(uint32_t));
+  if (vm->builtin_symbols == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+  for (size_t i=0; i<BUILTIN_COUNT; i++) {
+    sdm_string_view name = sdm_cstr_as_sv((char*)builtins[i].name);
+    vm->builtin_symbols[i] = intern_symbol(name, sdm_sv_hash(name));
+  }
+}
+
+static void emit(Vm *vm, VmOpcode op, uint32_t dst, uint32_t lhs, uint32_t rhs, uint32_t operand, uint32_t offset) {
+  VmInstruction instruction = {
+    .op = op,
+    .dst = (uint8_t)dst,
+    .lhs = (uint8_t)lhs,
+    .rhs = (uint8_t)rhs,
+    .operand = operand,
+  };
+  SDM_ARRAY_PUSH(vm->code, instruction);
+  SDM_ARRAY_PUSH(vm->offsets, offset);
+}
+
+static uint32_t add_constant(Vm *vm, Value value) {
+  SDM_ARRAY_PUSH(vm->constants, value);
+  return (uint32_t)(vm->constants.length - 1);
+}
+
+static bool compile_expression(Vm *vm, uint32_t index, uint32_t dst) {
+  // Leaves the value of node index in register dst.  Registers above dst are free to
+  // use as temporaries, which is how the operands of nested expressions are kept apart.
+  const Ast *ast = vm->evaluator->ast;
+  const AstNode *node = ast_node(ast, index);
+
+  if (dst >= VM_REGISTER_COUNT) {
+    ast_error(ast, node->offset, "Expression is too deeply nested (the limit is %d registers)", VM_REGISTER_COUNT);
+    return false;
+  }
+
+  switch ((AstNodeKind)node->kind) {
+    case AST_NODE_INT:
+    case AST_NODE_FLOAT:
+    case AST_NODE_STRING: {
+      Value value;
+      if (!evaluate_expression(vm->evaluator, index, &value)) return false;
+      emit(vm, VM_OP_LOAD_CONST, dst, 0, 0, add_constant(vm, value), node->offset);
+      return true;
+    }
+    case AST_NODE_IDENT:
+      emit(vm, VM_OP_LOAD_GLOBAL, dst, 0, 0, node->rhs, node->offset);
+      return true;
+    case AST_NODE_NEGATE:
+      if (!compile_expression(vm, node->lhs, dst)) return false;
+      emit(vm, VM_OP_NEG, dst, dst, 0, 0, node->offset);
+      return true;
+    case AST_NODE_BINARY: {
+      if (!compile_expression(vm, node->lhs, dst)) return false;
+      if (!compile_expression(vm, node->rhs, dst + 1)) return false;
+      VmOpcode op;
+      switch (node->op) {
+        case TOKEN_TYPE_ADD:  op = VM_OP_ADD; break;
+        case TOKEN_TYPE_SUB:  op = VM_OP_SUB; break;
+        case TOKEN_TYPE_MULT: op = VM_OP_MUL; break;
+        default:              op = VM_OP_DIV; break;
+      }
+      emit(vm, op, dst, dst, dst + 1, 0, node->offset);
+      return true;
+    }
+    case AST_NODE_CALL: {
+      if (node->op != KEYWORD_NONE) {
+        ast_error(ast, node->offset, "%s can only be used in a let binding", keyword_name(node->op));
+        return false;
+      }
+      uint32_t builtin = find_builtin(vm, node->lhs);
+      if (builtin == NO_BUILTIN) {
+        ast_error(ast, node->offset, "Unknown function '%s'", symbol_name(node->lhs).data);
+        return false;
+      }
+      AstCallArgs args = ast_call_args(ast, node);
+      if (!check_arity(ast, node, &builtins[builtin], args.count)) return false;
+      if (dst + 1 + args.count > VM_REGISTER_COUNT) {
+        ast_error(ast, node->offset, "Too many arguments (the limit is %d registers)", VM_REGISTER_COUNT);
+        return false;
+      }
+      for (uint32_t i=0; i<args.count; i++) {
+        const AstNode *arg = ast_node(ast, args.args[i]);
+        if (arg->kind == AST_NODE_NAMED_ARG) {
+          ast_error(ast, arg->offset, "Named arguments can only be given to constructors");
+          return false;
+        }
+        if (!compile_expression(vm, args.args[i], dst + 1 + i)) return false;
+      }
+      emit(vm, VM_OP_CALL, dst, dst + 1, args.count, builtin, node->offset);
+      return true;
+    }
+    case AST_NODE_NAMED_ARG:
+    case AST_NODE_LET:
+    case AST_NODE_EXPR_STMT:
+    case AST_NODE_KIND_COUNT:
+      break;
+  }
+
+  ast_error(ast, node->offset, "Not an expression");
+  return false;
+}
+
+bool vm_compile(Vm *vm) {
+  const Ast *ast = vm->evaluator->ast;
+  bool ok = true;
+  for (size_t i=0; i<ast->statements.length; i++) {
+    const AstNode *statement = ast_node(ast, ast->statements.data[i]);
+    if (statement->kind != AST_NODE_EXPR_STMT) continue;
+    ok = compile_expression(vm, statement->lhs, 0) && ok;
+  }
+  emit(vm, VM_OP_HALT, 0, 0, 0, 0, 0);
+  return ok;
+}
+
+#ifdef VM_COMPUTED_GOTO
+// Label addresses and computed gotos are what -Wpedantic warns about
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+bool vm_run(Vm *vm) {
+  if (vm->code.length == 0) return true;
+
+  const VmInstruction *code = vm->code.data;
+  const VmInstruction *ip = code;
+  Value *r = vm->registers;
+  const char *error = NULL;
+
+#ifdef VM_COMPUTED_GOTO
+  static const void *dispatch[VM_OP_COUNT] = {
+#define X(name) [VM_OP_##name] = &&op_##name,
+    VM_OPCODES(X)
+#undef X
+  };
+#define VM_CASE(name) op_##name:
+#define VM_NEXT() goto *dispatch[(++ip)->op]
+  goto *dispatch[ip->op];
+#else
+#define VM_CASE(name) case VM_OP_##name:
+#define VM_NEXT() ip++; continue
+  for (;;) switch ((VmOpcode)ip->op) {
+#endif
+
+  VM_CASE(HALT)
+    return true;
+
+  VM_CASE(LOAD_CONST)
+    r[ip->dst] = vm->constants.data[ip->operand];
+    VM_NEXT();
+
+  VM_CASE(LOAD_GLOBAL)
+    // The evaluator reports its own errors
+    if (!evaluate_binding(vm->evaluator, ip->operand, &r[ip->dst])) return false;
+    VM_NEXT();
+
+  VM_CASE(NEG)
+    if ((error = value_negate(r[ip->lhs], &r[ip->dst])) != NULL) goto fail;
+    VM_NEXT();
+
+// Float arithmetic is done inline; ints and mixed operands go through the shared helper
+#define VM_ARITHMETIC(name, token, operator)                                                 \
+  VM_CASE(name)                                                                              \
+    if (r[ip->lhs].kind == VALUE_FLOAT && r[ip->rhs].kind == VALUE_FLOAT) {                  \
+      r[ip->dst].as.float_value = r[ip->lhs].as.float_value operator r[ip->rhs].as.float_value; \
+      r[ip->dst].kind = VALUE_FLOAT;                                                         \
+    } else if ((error = value_binary_op(token, r[ip->lhs], r[ip->rhs], &r[ip->dst])) != NULL) { \
+      goto fail;                                                                             \
+    }                                                                                        \
+    VM_NEXT();
+
+  VM_ARITHMETIC(ADD, TOKEN_TYPE_ADD, +)
+  VM_ARITHMETIC(SUB, TOKEN_TYPE_SUB, -)
+  VM_ARITHMETIC(MUL, TOKEN_TYPE_MULT, *)
+  VM_ARITHMETIC(DIV, TOKEN_TYPE_DIV, /)
+#undef VM_ARITHMETIC
+
+  VM_CASE(CALL)
+    if ((error = builtins[ip->operand].function(vm, &r[ip->lhs], ip->rhs, &r[ip->dst])) != NULL) goto fail;
+    VM_NEXT();
+
+#ifndef VM_COMPUTED_GOTO
+    default:
+      error = "Bad instruction";
+      goto fail;
+  }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+
+fail:
+  ast_error(vm->evaluator->ast, vm->offsets.data[ip - code], "%s", error);
+  return false;
+}
+
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
@@ -0,0 +1,88 @@
+#ifndef _VM_LIB_H
+#define _VM_LIB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ast_lib.h"
+#include "eval_lib.h"
+#include "line_lib.h"
+
+// The top-level statements of a program are compiled to instructions for a small
+// register machine.  Each instruction writes register dst; the arithmetic ones read
+// registers lhs and rhs.  `let` bindings are not compiled: LOAD_GLOBAL asks the
+// evaluator for them, so each is still only worked out once.
+#define VM_OPCODES(X)                                                          \
+  X(HALT)                                                                      \
+  X(LOAD_CONST)   /* dst = constants[operand] */                               \
+  X(LOAD_GLOBAL)  /* dst = value of binding operand */                         \
+  X(NEG)          /* dst = -lhs */                                             \
+  X(ADD)          /* dst = lhs + rhs */                                        \
+  X(SUB)                                                                       \
+  X(MUL)                                                                       \
+  X(DIV)                                                                       \
+  X(CALL)         /* dst = builtins[operand](registers lhs .. lhs + rhs - 1) */
+
+typedef enum {
+#define X(name) VM_OP_##name,
+  VM_OPCODES(X)
+#undef X
+  VM_OP_COUNT,
+} VmOpcode;
+
+typedef struct {
+  uint8_t op;
+  uint8_t dst;
+  uint8_t lhs;
+  uint8_t rhs;
+  uint32_t operand;
+} VmInstruction;
+
+#define VM_REGISTER_COUNT 256
+
+typedef struct {
+  size_t capacity;
+  size_t length;
+  VmInstruction *data;
+} VmCode;
+
+typedef struct {
+  size_t capacity;
+  size_t length;
+  Value *data;
+} ValueArray;
+
+typedef struct Vm Vm;
+
+// Returns NULL on success, or a description of what went wrong
+typedef const char *(*BuiltinFunction)(Vm *vm, const Value *args, uint32_t count, Value *result);
+
+typedef struct {
+  const char *name;
+  uint32_t min_args;
+  uint32_t max_args;
+  BuiltinFunction function;
+  bool pure;  // Has no side effects, so the evaluator may call it on any thread
+} Builtin;
+
+struct Vm {
+  Evaluator *evaluator;
+  FILE *output;             // Where println writes; stdout if NULL
+  Lattice *lattice;         // What the line builtins look at; they fail if it is NULL
+  VmCode code;
+  AstIndexArray offsets;    // Source offset of each instruction, for error messages
+  ValueArray constants;
+  uint32_t *builtin_symbols;
+  Value registers[VM_REGISTER_COUNT];
+};
+
+// Also routes calls made while evaluating `let` bindings to the builtins
+void vm_init(Vm *vm, Evaluator *evaluator);
+// Appends code for every top-level expression statement.  Returns false (after
+// reporting) for calls to unknown functions and the like.
+bool vm_compile(Vm *vm);
+bool vm_run(Vm *vm);
+
+#endif // !_VM_LIB_H
+